@@ -4,17 +4,26 @@ use std::{
     env,
     io::{self, prelude::*},
     process::Stdio,
-    sync::Arc,
+    sync::{Arc, Mutex},
+    time::Duration,
 };
 use tokio::{
     process::{Child, Command},
-    sync,
+    sync, time,
 };
 use ya_runtime_vm::guest_agent_comm::{GuestAgent, Notification, RedirectFdType};
 
+#[derive(Default)]
+struct Streams {
+    received: u64,
+    died: Vec<u64>,
+}
+
 struct Notifications {
     process_died: sync::Notify,
     output_available: sync::Notify,
+    streams: Mutex<Streams>,
+    streams_changed: sync::Notify,
 }
 
 impl Notifications {
@@ -22,6 +31,8 @@ impl Notifications {
         Notifications {
             process_died: sync::Notify::new(),
             output_available: sync::Notify::new(),
+            streams: Mutex::new(Streams::default()),
+            streams_changed: sync::Notify::new(),
         }
     }
 
@@ -34,13 +45,26 @@ impl Notifications {
             Notification::ProcessDied { id, reason } => {
                 println!("Process {} died with {:?}", id, reason);
                 self.process_died.notify_waiters();
+                self.streams.lock().unwrap().died.push(id);
+                self.streams_changed.notify_one();
+            }
+            Notification::OutputDropped { id, fd, dropped } => {
+                println!(
+                    "Process {} dropped {} bytes of output on fd {}",
+                    id, dropped, fd
+                );
+            }
+            Notification::OutputData { id, fd, data } => {
+                println!("Process {} sent {} bytes on fd {}", id, data.len(), fd);
+                self.streams.lock().unwrap().received += data.len() as u64;
+                self.streams_changed.notify_one();
             }
         }
     }
 }
 
 async fn run_process_with_output(
-    ga: &mut GuestAgent,
+    ga: &GuestAgent,
     notifications: &Notifications,
     bin: &str,
     argv: &[&str],
@@ -74,6 +98,52 @@ async fn run_process_with_output(
     Ok(())
 }
 
+/// Streams `len` bytes from a process and credits them only after it exits, so
+/// that the next stream depends on that credit reaching the channel.
+async fn stream_output_after_exit(
+    ga: &GuestAgent,
+    notifications: &Notifications,
+    len: u64,
+) -> io::Result<()> {
+    let received = notifications.streams.lock().unwrap().received;
+    let cmd = format!("head -c {} /dev/zero", len);
+    let id = ga
+        .run_process(
+            "/bin/bash",
+            &["bash", "-c", &cmd],
+            None,
+            0,
+            0,
+            &[None, Some(RedirectFdType::RedirectFdPipeStream(len)), None],
+            None,
+        )
+        .await?
+        .expect("Run process failed");
+    println!("Spawned process with id: {}", id);
+
+    let done = async {
+        loop {
+            let notified = notifications.streams_changed.notified();
+            {
+                let streams = notifications.streams.lock().unwrap();
+                if streams.received - received >= len && streams.died.contains(&id) {
+                    break;
+                }
+            }
+            notified.await;
+        }
+    };
+    time::timeout(Duration::from_secs(10), done)
+        .await
+        .map_err(|_| io::Error::new(io::ErrorKind::TimedOut, "Output stream stalled"))?;
+
+    ga.output_credit(id, 1, len)
+        .await?
+        .expect("Output credit failed");
+    println!("Streamed {} bytes from exited process {}", len, id);
+    Ok(())
+}
+
 fn get_project_dir() -> PathBuf {
     PathBuf::from(env::var("CARGO_MANIFEST_DIR").unwrap())
         .canonicalize()
@@ -169,12 +239,11 @@ async fn main() -> io::Result<()> {
     let mut child = spawn_vm(temp_path, &mount_args);
 
     let ns = notifications.clone();
-    let ga_mutex = GuestAgent::connected(temp_path.join("manager.sock"), 10, move |n, _g| {
+    let ga = GuestAgent::connected(temp_path.join("manager.sock"), 10, move |n, _g| {
         let notifications = ns.clone();
         async move { notifications.clone().handle(n) }.boxed()
     })
     .await?;
-    let mut ga = ga_mutex.lock().await;
 
     let no_redir = [None, None, None];
 
@@ -206,7 +275,7 @@ async fn main() -> io::Result<()> {
     io::stdout().write_all(&out)?;
 
     run_process_with_output(
-        &mut ga,
+        &ga,
         &notifications,
         "/bin/ls",
         &["ls", "-al", "/mnt/mnt1/tag1"],
@@ -228,7 +297,7 @@ async fn main() -> io::Result<()> {
     notifications.process_died.notified().await;
 
     run_process_with_output(
-        &mut ga,
+        &ga,
         &notifications,
         "/bin/cat",
         &["cat", "/mnt/mnt1/tag1/write_test"],
@@ -324,6 +393,11 @@ async fn main() -> io::Result<()> {
         .expect("Output query failed");
     println!("Big output 2: {}, expected 0", out.len());
 
+    // Five times the largest buffer is more than the channel credit.
+    for _ in 0..5 {
+        stream_output_after_exit(&ga, &notifications, 0x100000).await?;
+    }
+
     // ga.quit().await?.expect("Quit failed");
 
     let id = ga
@@ -32,7 +32,7 @@ const PREFIX_LEN: usize = 2;
 
 struct Notifications {
     process_died: sync::Notify,
-    ga: Option<Arc<Mutex<GuestAgent>>>,
+    ga: Option<Arc<GuestAgent>>,
 }
 
 impl Notifications {
@@ -43,7 +43,7 @@ impl Notifications {
         }
     }
 
-    fn set_ga(&mut self, ga: Arc<Mutex<GuestAgent>>) {
+    fn set_ga(&mut self, ga: Arc<GuestAgent>) {
         self.ga.replace(ga);
     }
 
@@ -56,12 +56,7 @@ impl Notifications {
                 };
 
                 tokio::spawn(async move {
-                    match ga
-                        .lock()
-                        .await
-                        .query_output(id, fd as u8, 0u64, u64::MAX)
-                        .await
-                    {
+                    match ga.query_output(id, fd as u8, 0u64, u64::MAX).await {
                         Ok(res) => match res {
                             Ok(out) => while io::stdout().write_all(&out[..]).is_err() {},
                             Err(code) => eprintln!("Output query failed with: {}", code),
@@ -74,11 +69,20 @@ impl Notifications {
                 eprintln!("Process {} died with {:?}", id, reason);
                 self.process_died.notify_waiters();
             }
+            Notification::OutputDropped { id, fd, dropped } => {
+                eprintln!(
+                    "Process {} dropped {} bytes of output on fd {}",
+                    id, dropped, fd
+                );
+            }
+            Notification::OutputData { id, fd, data } => {
+                eprintln!("Process {} sent {} bytes on fd {}", id, data.len(), fd);
+            }
         }
     }
 }
 
-async fn run_process(ga: &mut GuestAgent, bin: &str, argv: &[&str]) -> io::Result<()> {
+async fn run_process(ga: &GuestAgent, bin: &str, argv: &[&str]) -> io::Result<()> {
     let id = ga
         .run_process(
             bin,
@@ -374,14 +378,14 @@ async fn main() -> anyhow::Result<()> {
     let mut child = spawn_vm(temp_path);
 
     let ns = notifications.clone();
-    let ga_mutex = GuestAgent::connected(temp_path.join("manager.sock"), 10, move |n, _g| {
+    let ga = GuestAgent::connected(temp_path.join("manager.sock"), 10, move |n, _g| {
         let notifications = ns.clone();
         async move { notifications.clone().lock().await.handle(n) }.boxed()
     })
     .await?;
 
     {
-        notifications.clone().lock().await.set_ga(ga_mutex.clone());
+        notifications.clone().lock().await.set_ga(ga.clone());
     };
 
     handle_net(temp_path.join("net.sock")).await?;
@@ -393,7 +397,6 @@ async fn main() -> anyhow::Result<()> {
             .map(|(h, i)| (h.to_string(), i.to_string()))
             .collect::<Vec<_>>();
 
-        let mut ga = ga_mutex.lock().await;
         match ga.add_address("10.0.0.1", "255.255.255.0", iface).await? {
             Ok(_) | Err(0) => (),
             Err(code) => anyhow::bail!("Unable to set address {}", code),
@@ -410,15 +413,12 @@ async fn main() -> anyhow::Result<()> {
             Err(code) => anyhow::bail!("Unable to add hosts {}", code),
         }
     }
-    {
-        let mut ga = ga_mutex.lock().await;
-        run_process(
-            &mut ga,
-            "/bin/ping",
-            &["ping", "-v", "-n", "-D", "-c", "3", "10.0.0.2"],
-        )
-        .await?;
-    }
+    run_process(
+        &ga,
+        "/bin/ping",
+        &["ping", "-v", "-n", "-D", "-c", "3", "10.0.0.2"],
+    )
+    .await?;
 
     /* VM should quit now. */
     let e = child.wait().await.expect("failed to wait on child");
@@ -3,8 +3,17 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
-#include "cyclic_buffer.h"
+
+/*
+ * Makes `readn` (and thus all `recv_*` functions) on `fd` read ahead into
+ * a buffer of `size` bytes. Only one fd can be buffered at a time.
+ * Returns 0 on success and -1 on error (error code in `errno`).
+ */
+int recv_buffer_attach(int fd, size_t size);
+/* Returns the number of bytes already read from `fd` but not consumed yet. */
+size_t recv_buffer_pending(int fd);
 
 int readn(int fd, void* buf, size_t size);
 
@@ -21,8 +30,40 @@ void free_strings_array(char** array);
 
 int writen(int fd, const void* buf, size_t size);
 
-int send_bytes(int fd, const char* buf, uint64_t size);
+/* Maximal number of messages written with a single `writev`. */
+#define SEND_QUEUE_IOV_MAX 64
+
+/*
+ * Makes `send_iov` on `fd` queue messages instead of blocking on it, which
+ * should be non-blocking. Only one fd can be queued at a time.
+ */
+void send_queue_attach(int fd);
+/* Returns the number of bytes queued for `fd` and not written yet. */
+size_t send_queue_pending(int fd);
+/*
+ * Writes as much of the queue as `fd` accepts without blocking.
+ * Returns 0 on success and -1 on error (error code in `errno`).
+ */
+int send_queue_flush(int fd);
+/*
+ * Writes the whole queue, waiting at most `timeout_ms` (-1 for no limit) for
+ * `fd` to become writable each time it is full.
+ * Returns 0 on success and -1 on error (error code in `errno`).
+ */
+int send_queue_drain(int fd, int timeout_ms);
 
-int send_bytes_cyclic_buffer(int fd, struct cyclic_buffer* cb, uint64_t size);
+/*
+ * Sends a message made of `iovcnt` parts. On a queued fd the message is
+ * copied into the queue, which is then flushed, otherwise it is written with
+ * `writen`.
+ * Returns 0 on success and -1 on error (error code in `errno`).
+ */
+int send_iov(int fd, const struct iovec* iov, int iovcnt);
+/*
+ * Same as `send_iov`, but on a queued fd the message is queued behind all the
+ * others, while the ones sent with `send_iov` are put ahead of any bulk
+ * messages not being written yet.
+ */
+int send_iov_bulk(int fd, const struct iovec* iov, int iovcnt);
 
 #endif // _COMMUNICATION_H
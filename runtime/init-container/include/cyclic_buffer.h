@@ -1,6 +1,9 @@
 #ifndef _CYCLIC_BUFFER_H
 #define _CYCLIC_BUFFER_H
 
+#include <stdbool.h>
+#include <sys/uio.h>
+
 /*
  * Struct describing a cyclic buffer.
  * `buf` - pointer to the beginning of the buffer,
@@ -13,16 +16,25 @@
  * - `begin == buf` - buffer is empty,
  * - `begin != buf` - buffer is full.
  * If the buffer is full and `begin == buf`, then `end == buf + size`.
+ * `mirrored` - the buffer is mapped twice back to back, so that `size` bytes
+ *              starting at any position in `[buf, buf+size]` are contiguous
+ *              and data never has to be split at the end of the buffer.
+ * `huge` - the buffer is backed by (non transparent) huge pages.
  */
 struct cyclic_buffer {
     char* buf;
     size_t size;
     char* begin;
     char* end;
+    bool mirrored;
+    bool huge;
 };
 
 /*
- * Initializes the buffer.
+ * Initializes the buffer. If `size` is a multiple of the page size, the buffer
+ * is mirrored. Buffers of a multiple of 2 MiB are backed by huge pages if the
+ * kernel has them reserved, larger buffers are marked for transparent huge
+ * pages otherwise.
  * Returns 0 on success and -1 on error (error code in `errno`).
  */
 int cyclic_buffer_init(struct cyclic_buffer* cb, size_t size);
@@ -33,10 +45,39 @@ int cyclic_buffer_init(struct cyclic_buffer* cb, size_t size);
  */
 int cyclic_buffer_deinit(struct cyclic_buffer* cb);
 
+/*
+ * Moves the buffer contents into a new buffer of `size` bytes, which must be
+ * able to hold all the data currently stored.
+ * Returns 0 on success and -1 on error (error code in `errno`). If allocating
+ * the new buffer fails, the old one is left intact.
+ */
+int cyclic_buffer_resize(struct cyclic_buffer* cb, size_t size);
+
 /* Returns the size of data in the buffer. */
 size_t cyclic_buffer_data_size(struct cyclic_buffer* cb);
 /* Returns the size of the free space in the buffer. */
 size_t cyclic_buffer_free_size(struct cyclic_buffer* cb);
+/*
+ * Describes at most `count` oldest bytes of the buffer with two segments
+ * (the second one is empty unless the data wraps around), without consuming
+ * them. Returns the number of bytes described.
+ */
+size_t cyclic_buffer_peek(struct cyclic_buffer* cb, size_t count,
+                          struct iovec iov[2]);
+
+/*
+ * Gives the memory backing the free part of the buffer back to the kernel.
+ * The buffer stays usable, released pages are faulted in again on reuse.
+ * Buffers backed by huge pages keep their memory.
+ * Returns 0 on success and -1 on error (error code in `errno`).
+ */
+int cyclic_buffer_release_free(struct cyclic_buffer* cb);
+
+/*
+ * Drops at most `count` oldest bytes from the buffer.
+ * Returns the number of bytes actually dropped.
+ */
+size_t cyclic_buffer_discard(struct cyclic_buffer* cb, size_t count);
 
 /*
  * Reads at most `count` bytes from `fd` into the buffer.
@@ -61,4 +102,12 @@ ssize_t cyclic_buffer_read(int fd, struct cyclic_buffer* cb, size_t count);
  */
 ssize_t cyclic_buffer_write(int fd, struct cyclic_buffer* cb, size_t count);
 
+/*
+ * Same as `cyclic_buffer_read` and `cyclic_buffer_write`, but both segments
+ * of the buffer (on either side of its end) are transferred with a single
+ * `readv`/`writev` call.
+ */
+ssize_t cyclic_buffer_readv(int fd, struct cyclic_buffer* cb, size_t count);
+ssize_t cyclic_buffer_writev(int fd, struct cyclic_buffer* cb, size_t count);
+
 #endif // _CYCLIC_BUFFER_H
@@ -1,15 +1,86 @@
 #ifndef _FORWARD_H
 #define _FORWARD_H
 
+#include <stdint.h>
 #include <sys/types.h>
 
-int fwd_start(
-    int rfd,
-    int wfd,
-    uint16_t read_sz,
-    char read_hdr,
-    char write_hdr
-);
+enum fwd_mode {
+    /* Sleep in the kernel until an operation completes. */
+    FWD_MODE_BLOCKING = 0,
+    /* Submissions are picked up by a kernel thread polling the ring. */
+    FWD_MODE_SQPOLL,
+    /* Busy-poll for completions for a while after traffic, then sleep. */
+    FWD_MODE_ADAPTIVE,
+};
+
+enum fwd_flags {
+    /* Frames are read from a stream, each prefixed with its length. */
+    FWD_READ_HDR = 1 << 0,
+    /* Frames are written to a stream, each prefixed with its length. */
+    FWD_WRITE_HDR = 1 << 1,
+    /* Splice frames to the sink instead of copying them into the kernel.
+     * Requires a packet source, `FWD_WRITE_HDR` and a character device sink
+     * (a virtio-serial port), which copies the pages it is given. */
+    FWD_SPLICE = 1 << 2,
+    /* Use a 32-bit length prefix, e.g. for GSO frames with a virtio-net
+     * header which exceed 64 KiB. */
+    FWD_LEN32 = 1 << 3,
+};
+
+/* Rate limit of a forwarder, a zero rate is not limited. */
+struct fwd_rate {
+    uint64_t bytes_per_sec;
+    uint64_t frames_per_sec;
+    /* Time for which traffic may exceed the rates in a burst [us]. */
+    uint32_t burst_us;
+};
+
+/* Upper bounds of the frame size histogram buckets, the last one is open. */
+#define FWD_HIST_BOUNDS     { 64, 128, 256, 512, 1024, 1518, 9018 }
+#define FWD_HIST_LEN        8
+
+struct fwd_stats {
+    /* Frames written out and their size, without length prefixes. */
+    uint64_t frames;
+    uint64_t bytes;
+    /* Reads which returned no data or, from a stream, less than requested. */
+    uint64_t short_reads;
+    /* Writes resubmitted after a failure or to finish a partial write. */
+    uint64_t write_retries;
+    /* Time reads were held back since every buffer awaited writing [ns]. */
+    uint64_t stall_ns;
+    /* Batches written to a stream and the frames they carried. */
+    uint64_t batches;
+    uint64_t batch_frames;
+    /* Number of times the forwarder woke up after its read side went idle. */
+    uint64_t wakeups;
+    /* Time from the read side becoming ready to the first data read [ns]. */
+    uint64_t wake_ns_total;
+    uint64_t wake_ns_max;
+    /* Frames written out, by size, see `FWD_HIST_BOUNDS`. */
+    uint64_t hist[FWD_HIST_LEN];
+    /* Length prefixes read from a stream exceeding the read size. The stream
+     * cannot be followed past one, so the forwarder stops. */
+    uint64_t proto_errors;
+};
+
+/* Registers a forwarder. All forwarders have to be added before `fwd_run`.
+ * Returns the forwarder ID on success and a negative error code on failure. */
+int fwd_add(int rfd, int wfd, uint32_t read_sz, int flags);
+/* Runs the forwarder on the thread pinned to `cpu`. With fewer threads than
+ * CPUs, a thread is pinned to the CPUs of all the forwarders it runs. */
+int fwd_set_cpu(int id, int cpu);
+/* Makes the forwarder share the rate limit of `leader`, e.g. for the queues
+ * of a single interface. Has to be called before `fwd_run`. */
+int fwd_share_rate(int id, int leader);
+/* Limits the rate of frames written by the forwarder and by those sharing its
+ * limit. Can be called while forwarding. */
+int fwd_set_rate(int id, const struct fwd_rate *rate);
+/* Starts forwarding on `threads` threads, each multiplexing its share of the
+ * forwarders on a single io_uring instance. `busy_poll_us` is the polling
+ * window of the adaptive mode and the idle time of the SQPOLL kernel thread. */
+int fwd_run(int threads, enum fwd_mode mode, uint32_t busy_poll_us);
 void fwd_stop();
+int fwd_get_stats(int id, struct fwd_stats *stats);
 
 #endif // _FORWARD_H
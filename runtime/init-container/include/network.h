@@ -2,7 +2,10 @@
 #define _NETWORK_H
 
 int net_create_lo(char *name);
-int net_create_tap(char *name);
+/* `vnet_hdr` prefixes every frame with a `struct virtio_net_hdr` and enables
+ * checksum and TSO offloads on the device. With `multi_queue`, each call with
+ * the name of an existing tap returns a descriptor of a new queue. */
+int net_create_tap(char *name, int vnet_hdr, int multi_queue);
 
 int net_if_up(const char *name, int up);
 int net_if_mtu(const char *name, int mtu);
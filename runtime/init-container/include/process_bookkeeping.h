@@ -17,6 +17,16 @@ struct redir_fd_desc {
         struct {
             struct cyclic_buffer cb;
             int fds[2];
+            /* Size the buffer may grow up to. */
+            size_t max_size;
+            /* Bytes overwritten in REDIRECT_FD_PIPE_CYCLIC mode. */
+            uint64_t dropped;
+            /* Whether the host was told about drops since its last query. */
+            bool drop_notified;
+            /* Whether there was any output or query since the last idle check. */
+            bool active;
+            /* Bytes the host accepts in REDIRECT_FD_PIPE_STREAM mode. */
+            uint64_t credit;
         } buffer;
     };
 };
@@ -34,5 +44,6 @@ void add_process(struct process_desc* proc_desc);
 void remove_process(struct process_desc* proc_desc);
 struct process_desc* find_process_by_id(uint64_t id);
 struct process_desc* find_process_by_pid(pid_t pid);
+void for_each_process(void (*fn)(struct process_desc*));
 
 #endif // _PROCESS_BOOKKEEPING_H
@@ -28,6 +28,10 @@
  * Guest sends two types of messages - response and asynchronous notification:
  * - u64: message ID matching the request for response, 0 for notification,
  * - 1 byte type, followed by type-specific body.
+ *
+ * Notifications keep their order, but responses may overtake notifications
+ * that were not being sent yet, so that e.g. streamed output does not delay
+ * them.
  */
 
 typedef uint64_t msg_id_t;
@@ -69,6 +73,15 @@ enum HOST_MSG_TYPE {
 
     /* Expected response: RESP_OK */
     MSG_NET_HOST,
+
+    /* Expected response: RESP_OK_BYTES - array of `struct net_stats` */
+    MSG_NET_STATS,
+
+    /* Expected response: RESP_BATCH - responses to the items, in order. */
+    MSG_BATCH,
+
+    /* Expected response: RESP_OK */
+    MSG_OUTPUT_CREDIT,
 };
 
 enum SUB_MSG_QUIT_TYPE {
@@ -167,6 +180,12 @@ enum SUB_MSG_NET_CTL {
     SUB_MSG_NET_CTL_IF_ADDR,
     /* Network interface kind. (u16) */
     SUB_MSG_NET_CTL_IF,
+    /* Rate limit of the interface, 0 for none. [bytes/s] (u64) */
+    SUB_MSG_NET_CTL_RATE_BPS,
+    /* Rate limit of the interface, 0 for none. [frames/s] (u64) */
+    SUB_MSG_NET_CTL_RATE_PPS,
+    /* Time for which the rates may be exceeded in a burst. [us] (u32) */
+    SUB_MSG_NET_CTL_RATE_BURST,
 };
 
 enum SUB_MSG_NET_CTL_FLAGS {
@@ -186,6 +205,86 @@ enum SUB_MSG_NET_HOST {
     SUB_MSG_NET_HOST_ENTRY,
 };
 
+enum SUB_MSG_NET_STATS {
+    /* End of sub-messages. */
+    SUB_MSG_NET_STATS_END = 0,
+};
+
+enum SUB_MSG_BATCH {
+    /* End of sub-messages. */
+    SUB_MSG_BATCH_END = 0,
+    /* Message type, followed by the sub-messages of that type, including its
+     * end marker. Items are executed in order. Allowed types are:
+     * MSG_RUN_PROCESS, MSG_KILL_PROCESS, MSG_MOUNT_VOLUME, MSG_QUERY_OUTPUT,
+     * MSG_NET_CTL, MSG_NET_HOST, MSG_NET_STATS and MSG_OUTPUT_CREDIT.
+     * (u8 + sub-messages) */
+    SUB_MSG_BATCH_ITEM,
+};
+
+enum SUB_MSG_OUTPUT_CREDIT {
+    /* End of sub-messages. */
+    SUB_MSG_OUTPUT_CREDIT_END = 0,
+    /* Process ID. (u64) */
+    SUB_MSG_OUTPUT_CREDIT_ID,
+    /* File descriptor with a REDIRECT_FD_PIPE_STREAM redirect. (u8) */
+    SUB_MSG_OUTPUT_CREDIT_FD,
+    /* Number of bytes the host is ready to receive on top of the credit it
+     * gave before. (u64) */
+    SUB_MSG_OUTPUT_CREDIT_BYTES,
+    /* Same as SUB_MSG_OUTPUT_CREDIT_BYTES, but for all the streams together;
+     * process ID and file descriptor are not needed then. Applied even when
+     * the process is gone, which is not an error then. (u64) */
+    SUB_MSG_OUTPUT_CREDIT_CHANNEL,
+};
+
+/* Credit for output of all REDIRECT_FD_PIPE_STREAM redirects together that
+ * the host starts with. Each chunk of output needs both credits. */
+#define OUTPUT_CHANNEL_CREDIT (4 * 1024 * 1024)
+
+enum NET_STATS_DIR {
+    /* From the guest's network interface to the host. */
+    NET_STATS_DIR_TX = 0,
+    /* From the host to the guest's network interface. */
+    NET_STATS_DIR_RX,
+};
+
+/* Upper bounds of the frame size histogram buckets, the last one is open. */
+#define NET_STATS_HIST_BOUNDS   { 64, 128, 256, 512, 1024, 1518, 9018 }
+#define NET_STATS_HIST_LEN      8
+
+/* Counters of a single forwarder, i.e. a queue of an interface in one
+ * direction. Sizes do not include length prefixes. */
+struct net_stats {
+    /* Network interface kind. (SUB_MSG_NET_IF) */
+    uint16_t iface;
+    /* Direction. (NET_STATS_DIR) */
+    uint8_t dir;
+    /* Queue of a multi-queue interface. */
+    uint8_t queue;
+    /* Frames forwarded. */
+    uint64_t frames;
+    /* Bytes forwarded. */
+    uint64_t bytes;
+    /* Reads which returned no data or less than requested. */
+    uint64_t short_reads;
+    /* Writes resubmitted after a failure or to finish a partial write. */
+    uint64_t write_retries;
+    /* Time reads were held back waiting for writes to complete [ns]. */
+    uint64_t stall_ns;
+    /* Batches written to the host and the frames they carried. */
+    uint64_t batches;
+    uint64_t batch_frames;
+    /* Wake-ups after the read side was idle and their latency [ns]. */
+    uint64_t wakeups;
+    uint64_t wake_ns_total;
+    uint64_t wake_ns_max;
+    /* Frames forwarded, by size. */
+    uint64_t hist[NET_STATS_HIST_LEN];
+    /* Invalid frame lengths received from the host, which stop forwarding
+     * in that direction. */
+    uint64_t proto_errors;
+};
+
 enum REDIRECT_FD_TYPE {
     /* Invalid type (useful only internally). */
     REDIRECT_FD_INVALID = -1,
@@ -193,8 +292,17 @@ enum REDIRECT_FD_TYPE {
     REDIRECT_FD_FILE = 0,
     /* Buffer size. (u64) */
     REDIRECT_FD_PIPE_BLOCKING,
-    /* Buffer size. (u64) */
+    /* Buffer size. (u64)
+     * When the buffer is full, the oldest output is overwritten and the
+     * number of dropped bytes is reported with NOTIFY_OUTPUT_DROPPED. */
     REDIRECT_FD_PIPE_CYCLIC,
+    /* Buffer size. (u64)
+     * Output is pushed to the host with NOTIFY_OUTPUT_DATA, instead of being
+     * announced with NOTIFY_OUTPUT_AVAILABLE. The host starts with a credit
+     * of the buffer size and grants more with MSG_OUTPUT_CREDIT, the guest
+     * never sends more than that (nor more than OUTPUT_CHANNEL_CREDIT).
+     * A full buffer blocks the writer. */
+    REDIRECT_FD_PIPE_STREAM,
 };
 
 enum GUEST_MSG_TYPE {
@@ -210,6 +318,15 @@ enum GUEST_MSG_TYPE {
     NOTIFY_OUTPUT_AVAILABLE,
     /* ID of process and exit reason (two bytes). (u64 + u8 + u8) */
     NOTIFY_PROCESS_DIED,
+    /* ID of process, a file descriptor and the total number of bytes dropped
+     * from its output so far. (u64 + u32 + u64) */
+    NOTIFY_OUTPUT_DROPPED,
+    /* Number of responses, followed by that many responses to the items of
+     * MSG_BATCH, each being 1 byte type and type-specific body. (u64 + ...) */
+    RESP_BATCH,
+    /* ID of process, a file descriptor and a chunk of its output.
+     * (u64 + u32 + BYTES) */
+    NOTIFY_OUTPUT_DATA,
 };
 
 #pragma pack(pop)
@@ -0,0 +1,72 @@
+#ifndef _SPSC_RING_H
+#define _SPSC_RING_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define SPSC_RING_CACHE_LINE 64
+
+/*
+ * Lock-free byte ring shared by exactly one producer and one consumer thread.
+ * `head` and `tail` are free running counts of bytes produced and consumed,
+ * `size` is a power of two, so the positions in `buf` are `head & (size - 1)`
+ * and `tail & (size - 1)`.
+ * Each side owns a cache line with its own counter and a cached copy of the
+ * other side's counter, which is refreshed only when the cached value shows
+ * less free space (or data) than the operation asks for.
+ * Functions are either producer (`push`, `read`) or consumer (`pop`, `write`)
+ * side; `data_size` and `free_size` might be called by either side, but are
+ * exact only for the consumer and the producer respectively.
+ */
+struct spsc_ring {
+    alignas(SPSC_RING_CACHE_LINE) atomic_size_t head;
+    size_t tail_cache;
+
+    alignas(SPSC_RING_CACHE_LINE) atomic_size_t tail;
+    size_t head_cache;
+
+    alignas(SPSC_RING_CACHE_LINE) char* buf;
+    size_t size;
+};
+
+/*
+ * Initializes the ring, `size` must be a power of two.
+ * Returns 0 on success and -1 on error (error code in `errno`).
+ */
+int spsc_ring_init(struct spsc_ring* ring, size_t size);
+/*
+ * Destroys the ring. Neither side may use it anymore.
+ * Returns 0 on success and -1 on error (error code in `errno`).
+ */
+int spsc_ring_deinit(struct spsc_ring* ring);
+
+/* Returns the size of data in the ring. */
+size_t spsc_ring_data_size(struct spsc_ring* ring);
+/* Returns the size of the free space in the ring. */
+size_t spsc_ring_free_size(struct spsc_ring* ring);
+
+/*
+ * Copies at most `len` bytes from `data` into the ring.
+ * Returns the number of bytes copied, 0 if the ring is full.
+ */
+size_t spsc_ring_push(struct spsc_ring* ring, const void* data, size_t len);
+/*
+ * Copies at most `len` bytes from the ring into `data`.
+ * Returns the number of bytes copied, 0 if the ring is empty.
+ */
+size_t spsc_ring_pop(struct spsc_ring* ring, void* data, size_t len);
+
+/*
+ * Same as `cyclic_buffer_readv` and `cyclic_buffer_writev`: reads at most
+ * `count` bytes from `fd` into the ring (producer side) and writes at most
+ * `count` bytes from the ring into `fd` (consumer side), with a single
+ * `readv`/`writev` call, handling `EINTR` internally.
+ * Unlike a cyclic buffer, the ring never overwrites data, so at most the free
+ * space is read.
+ */
+ssize_t spsc_ring_read(int fd, struct spsc_ring* ring, size_t count);
+ssize_t spsc_ring_write(int fd, struct spsc_ring* ring, size_t count);
+
+#endif // _SPSC_RING_H
@@ -1,29 +1,110 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "communication.h"
-#include "cyclic_buffer.h"
 
-int readn(int fd, void* buf, size_t size) {
-    while (size) {
+/*
+ * At most one fd can have a receive buffer, from which `readn` serves small
+ * reads, so that parsing a message takes one or two `read` calls instead of
+ * one per field.
+ */
+static struct {
+    int fd;
+    char* buf;
+    size_t size;
+    size_t begin;
+    size_t end;
+} g_recv_buf = { .fd = -1 };
+
+int recv_buffer_attach(int fd, size_t size) {
+    char* buf = malloc(size);
+    if (!buf) {
+        return -1;
+    }
+
+    free(g_recv_buf.buf);
+    g_recv_buf.fd = fd;
+    g_recv_buf.buf = buf;
+    g_recv_buf.size = size;
+    g_recv_buf.begin = 0;
+    g_recv_buf.end = 0;
+    return 0;
+}
+
+size_t recv_buffer_pending(int fd) {
+    if (fd != g_recv_buf.fd) {
+        return 0;
+    }
+    return g_recv_buf.end - g_recv_buf.begin;
+}
+
+/* Returns the result of `read`, except that 0 means the fd is not connected. */
+static ssize_t read_some(int fd, void* buf, size_t size) {
+    while (1) {
         ssize_t ret = read(fd, buf, size);
         if (ret == 0) {
+            /* A port without a host reads as EOF and polls readable, so there
+             * is nothing to wait on but time. */
             puts("Waiting for host connection ...");
             sleep(1);
             continue;
         }
-        if (ret < 0) {
-            if (errno == EINTR) {
-                continue;
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0 && errno == EAGAIN) {
+            /* The rest of a message is still on its way. */
+            struct pollfd pfd = { .fd = fd, .events = POLLIN };
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                return -1;
             }
-            /* `errno` should be set. */
+            continue;
+        }
+        /* `errno` should be set on errors. */
+        return ret;
+    }
+}
+
+int readn(int fd, void* buf, size_t size) {
+    bool buffered = fd == g_recv_buf.fd;
+
+    while (size) {
+        if (buffered && g_recv_buf.begin < g_recv_buf.end) {
+            size_t len = g_recv_buf.end - g_recv_buf.begin;
+            if (len > size) {
+                len = size;
+            }
+            memcpy(buf, g_recv_buf.buf + g_recv_buf.begin, len);
+            g_recv_buf.begin += len;
+            buf = (char*)buf + len;
+            size -= len;
+            continue;
+        }
+
+        ssize_t ret;
+        if (buffered && size < g_recv_buf.size) {
+            ret = read_some(fd, g_recv_buf.buf, g_recv_buf.size);
+            if (ret > 0) {
+                g_recv_buf.begin = 0;
+                g_recv_buf.end = ret;
+            }
+        } else {
+            /* Large payloads go directly to the caller. */
+            ret = read_some(fd, buf, size);
+            if (ret > 0) {
+                buf = (char*)buf + ret;
+                size -= ret;
+            }
+        }
+        if (ret < 0) {
             return -1;
         }
-        buf = (char*)buf + ret;
-        size -= ret;
     }
     return 0;
 }
@@ -122,15 +203,17 @@ out:
 int writen(int fd, const void* buf, size_t size) {
     while (size) {
         ssize_t ret = write(fd, buf, size);
-        if (ret == 0) {
-            puts("Waiting for host connection ...");
-            sleep(1);
+        if (ret < 0 && errno == EINTR) {
             continue;
         }
-        if (ret < 0) {
-            if (errno == EINTR) {
-                continue;
+        if (ret == 0 || (ret < 0 && errno == EAGAIN)) {
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                return -1;
             }
+            continue;
+        }
+        if (ret < 0) {
             /* `errno` should be set. */
             return -1;
         }
@@ -140,35 +223,178 @@ int writen(int fd, const void* buf, size_t size) {
     return 0;
 }
 
-int send_bytes(int fd, const char* buf, uint64_t size) {
-    if (writen(fd, &size, sizeof(size)) < 0) {
-        return -1;
-    }
+/* Messages waiting to be written to the queued fd, oldest first. */
+struct out_msg {
+    struct out_msg* next;
+    size_t len;
+    char data[];
+};
+
+static struct {
+    int fd;
+    struct out_msg* head;
+    struct out_msg** tail;
+    /* Where the next control message goes: after the control messages and
+     * the message being written, before any bulk ones. */
+    struct out_msg** ctl_tail;
+    /* Bytes of `head` already written. */
+    size_t off;
+    /* Bytes of all messages not written yet. */
+    size_t pending;
+} g_send_queue = {
+    .fd = -1,
+    .head = NULL,
+    .tail = &g_send_queue.head,
+    .ctl_tail = &g_send_queue.head,
+};
 
-    return writen(fd, buf, size);
+void send_queue_attach(int fd) {
+    g_send_queue.fd = fd;
 }
 
-int send_bytes_cyclic_buffer(int fd, struct cyclic_buffer* cb, uint64_t size) {
-    size_t cb_data_size = cyclic_buffer_data_size(cb);
-    if (size > cb_data_size) {
-        size = cb_data_size;
+size_t send_queue_pending(int fd) {
+    if (fd != g_send_queue.fd) {
+        return 0;
     }
+    return g_send_queue.pending;
+}
 
-    if (writen(fd, &size, sizeof(size)) < 0) {
-        return -1;
+/* Drops `len` written bytes from the front of the queue. */
+static void send_queue_consume(size_t len) {
+    g_send_queue.pending -= len;
+    while (len) {
+        struct out_msg* msg = g_send_queue.head;
+        size_t left = msg->len - g_send_queue.off;
+        if (len < left) {
+            g_send_queue.off += len;
+            return;
+        }
+
+        len -= left;
+        g_send_queue.head = msg->next;
+        g_send_queue.off = 0;
+        if (g_send_queue.ctl_tail == &msg->next) {
+            g_send_queue.ctl_tail = &g_send_queue.head;
+        }
+        free(msg);
+    }
+    if (!g_send_queue.head) {
+        g_send_queue.tail = &g_send_queue.head;
+        g_send_queue.ctl_tail = &g_send_queue.head;
     }
+}
 
-    while (size) {
-        ssize_t ret = cyclic_buffer_write(fd, cb, size);
-        if (ret == 0) {
-            puts("Waiting for host connection ...");
-            sleep(1);
+int send_queue_flush(int fd) {
+    while (g_send_queue.head) {
+        struct iovec iov[SEND_QUEUE_IOV_MAX];
+        size_t off = g_send_queue.off;
+        int iovcnt = 0;
+
+        for (struct out_msg* msg = g_send_queue.head;
+                msg && iovcnt < SEND_QUEUE_IOV_MAX; msg = msg->next) {
+            iov[iovcnt].iov_base = msg->data + off;
+            iov[iovcnt].iov_len = msg->len - off;
+            ++iovcnt;
+            off = 0;
+        }
+
+        ssize_t ret = writev(fd, iov, iovcnt);
+        if (ret < 0 && errno == EINTR) {
             continue;
         }
+        if (ret == 0 || (ret < 0 && errno == EAGAIN)) {
+            /* The rest goes once `fd` is writable again. */
+            return 0;
+        }
         if (ret < 0) {
+            /* `errno` should be set. */
             return -1;
         }
-        size -= ret;
+        send_queue_consume(ret);
     }
     return 0;
 }
+
+int send_queue_drain(int fd, int timeout_ms) {
+    while (1) {
+        if (send_queue_flush(fd) < 0) {
+            return -1;
+        }
+        if (!g_send_queue.pending) {
+            return 0;
+        }
+
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        int ret = poll(&pfd, 1, timeout_ms);
+        if (ret < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (ret == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if ((pfd.revents & POLLHUP) && !(pfd.revents & POLLOUT)) {
+            /* No host, poll would not wait for it to connect. */
+            if (timeout_ms >= 0) {
+                errno = ENOTCONN;
+                return -1;
+            }
+            puts("Waiting for host connection ...");
+            sleep(1);
+        }
+    }
+}
+
+static int queue_iov(int fd, const struct iovec* iov, int iovcnt, bool bulk) {
+    if (fd != g_send_queue.fd) {
+        for (int i = 0; i < iovcnt; ++i) {
+            if (writen(fd, iov[i].iov_base, iov[i].iov_len) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        len += iov[i].iov_len;
+    }
+
+    struct out_msg* msg = malloc(sizeof(*msg) + len);
+    if (!msg) {
+        return -1;
+    }
+    msg->next = NULL;
+    msg->len = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        memcpy(msg->data + msg->len, iov[i].iov_base, iov[i].iov_len);
+        msg->len += iov[i].iov_len;
+    }
+
+    if (bulk) {
+        *g_send_queue.tail = msg;
+        g_send_queue.tail = &msg->next;
+    } else {
+        struct out_msg** link = g_send_queue.ctl_tail;
+        if (link == &g_send_queue.head && g_send_queue.off) {
+            /* Do not cut into the message being written. */
+            link = &g_send_queue.head->next;
+        }
+        msg->next = *link;
+        *link = msg;
+        g_send_queue.ctl_tail = &msg->next;
+        if (!msg->next) {
+            g_send_queue.tail = &msg->next;
+        }
+    }
+    g_send_queue.pending += len;
+    return send_queue_flush(fd);
+}
+
+int send_iov(int fd, const struct iovec* iov, int iovcnt) {
+    return queue_iov(fd, iov, iovcnt, false);
+}
+
+int send_iov_bulk(int fd, const struct iovec* iov, int iovcnt) {
+    return queue_iov(fd, iov, iovcnt, true);
+}
@@ -1,17 +1,102 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdio.h>
 
 #include "cyclic_buffer.h"
 
+/* Huge page size the mappings are aligned to. */
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+/* Reserves `len` bytes of address space aligned to `align`. */
+static char* reserve(size_t len, size_t align) {
+    char* area = mmap(NULL, len + align, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE,
+                      -1, 0);
+    if (area == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+
+    char* buf = (char*)(((uintptr_t)area + align - 1) & ~(uintptr_t)(align - 1));
+    if (buf != area) {
+        munmap(area, buf - area);
+    }
+    munmap(buf + len, area + align - buf);
+    return buf;
+}
+
+/* Maps a memfd of `size` bytes twice, back to back. */
+static char* mirror_map(size_t size, bool huge) {
+    char* buf = MAP_FAILED;
+    int fd = memfd_create("cyclic_buffer",
+                          MFD_CLOEXEC | (huge ? MFD_HUGETLB : 0));
+    if (fd < 0) {
+        return MAP_FAILED;
+    }
+    if (ftruncate(fd, size) < 0) {
+        goto out;
+    }
+
+    /* Reserve the address range for both mappings first. */
+    buf = reserve(2 * size, huge ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE));
+    if (buf == MAP_FAILED) {
+        goto out;
+    }
+    for (size_t off = 0; off < 2 * size; off += size) {
+        if (mmap(buf + off, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                 fd, 0) == MAP_FAILED) {
+            int tmp = errno;
+            munmap(buf, 2 * size);
+            errno = tmp;
+            buf = MAP_FAILED;
+            goto out;
+        }
+    }
+
+out:
+    if (close(fd) < 0 && buf != MAP_FAILED) {
+        munmap(buf, 2 * size);
+        buf = MAP_FAILED;
+    }
+    return buf;
+}
+
 int cyclic_buffer_init(struct cyclic_buffer* cb, size_t size) {
-    cb->buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
-                   MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    long page_size = sysconf(_SC_PAGESIZE);
+    bool can_mirror = size && page_size > 0 && size % page_size == 0;
+
+    cb->mirrored = false;
+    cb->huge = false;
+    cb->buf = MAP_FAILED;
+    if (size && size % HUGE_PAGE_SIZE == 0) {
+        /* Only succeeds if the kernel has enough huge pages reserved. */
+        cb->buf = mirror_map(size, true);
+        cb->mirrored = cb->buf != MAP_FAILED;
+        if (cb->buf == MAP_FAILED) {
+            cb->buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+        }
+        cb->huge = cb->buf != MAP_FAILED;
+    }
+    if (cb->buf == MAP_FAILED && can_mirror) {
+        cb->buf = mirror_map(size, false);
+        cb->mirrored = cb->buf != MAP_FAILED;
+    }
+    if (cb->buf == MAP_FAILED) {
+        cb->buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    }
     if (cb->buf == MAP_FAILED) {
         return -1;
     }
+    if (!cb->huge && size >= HUGE_PAGE_SIZE) {
+        /* Transparent huge pages are just a hint, ignore failures. */
+        madvise(cb->buf, cb->mirrored ? 2 * size : size, MADV_HUGEPAGE);
+    }
 
     cb->size = size;
     cb->begin = cb->buf;
@@ -23,7 +108,7 @@ int cyclic_buffer_deinit(struct cyclic_buffer* cb) {
     if (cb->buf == MAP_FAILED || !cb->size) {
         return 0;
     }
-    int ret = munmap(cb->buf, cb->size);
+    int ret = munmap(cb->buf, cb->mirrored ? 2 * cb->size : cb->size);
     cb->buf = MAP_FAILED;
     return ret;
 }
@@ -55,7 +140,133 @@ static size_t min(size_t a, size_t b) {
     return a < b ? a : b;
 }
 
+/* Moves the end of data by `len` bytes just stored at `end`. */
+static void cyclic_buffer_produce(struct cyclic_buffer* cb, char* end, size_t len) {
+    cb->end = end + len;
+    if (cb->end > cb->buf + cb->size) {
+        cb->end -= cb->size;
+    }
+}
+
+/* Moves the beginning of data by `len` bytes out of `available_data`. */
+static void cyclic_buffer_consume(struct cyclic_buffer* cb, size_t len,
+                                  size_t available_data) {
+    if (len == available_data) {
+        // buffer is empty
+        cb->begin = cb->buf;
+        cb->end = cb->buf;
+    } else {
+        cb->begin += len;
+        if (cb->begin >= cb->buf + cb->size) {
+            cb->begin -= cb->size;
+        }
+    }
+}
+
+size_t cyclic_buffer_discard(struct cyclic_buffer* cb, size_t count) {
+    size_t available_data = cyclic_buffer_data_size(cb);
+
+    count = min(count, available_data);
+    if (count) {
+        cyclic_buffer_consume(cb, count, available_data);
+    }
+    return count;
+}
+
+int cyclic_buffer_resize(struct cyclic_buffer* cb, size_t size) {
+    size_t data_size = cyclic_buffer_data_size(cb);
+    struct cyclic_buffer new_cb;
+
+    if (size < data_size) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (cyclic_buffer_init(&new_cb, size) < 0) {
+        return -1;
+    }
+
+    /* Unless mirrored, the data might wrap around the end of the buffer. */
+    size_t head = data_size;
+    if (!cb->mirrored) {
+        head = min(data_size, cb->buf + cb->size - cb->begin);
+    }
+    memcpy(new_cb.buf, cb->begin, head);
+    memcpy(new_cb.buf + head, cb->buf, data_size - head);
+    cyclic_buffer_produce(&new_cb, new_cb.buf, data_size);
+
+    int ret = cyclic_buffer_deinit(cb);
+    *cb = new_cb;
+    return ret;
+}
+
+/* Releases the memory backing `[off, off+len)`, shrunk to whole pages. */
+static int release_range(struct cyclic_buffer* cb, size_t off, size_t len,
+                         size_t page_size) {
+    size_t begin = (off + page_size - 1) / page_size * page_size;
+    size_t end = (off + len) / page_size * page_size;
+
+    if (begin >= end) {
+        return 0;
+    }
+    if (cb->mirrored) {
+        /* Both views share the memfd, so its pages have to be punched out. */
+        return madvise(cb->buf + begin, end - begin, MADV_REMOVE);
+    }
+    if (madvise(cb->buf + begin, end - begin, MADV_FREE) < 0) {
+        if (errno != EINVAL) {
+            return -1;
+        }
+        /* Older kernels do not support lazy freeing. */
+        return madvise(cb->buf + begin, end - begin, MADV_DONTNEED);
+    }
+    return 0;
+}
+
+int cyclic_buffer_release_free(struct cyclic_buffer* cb) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t begin = cb->begin - cb->buf;
+    size_t end = cb->end - cb->buf;
+
+    /* Huge pages are reserved up front and would only go back to the pool;
+     * older kernels cannot drop them from a private mapping at all. */
+    if (cb->huge || cyclic_buffer_free_size(cb) == 0) {
+        return 0;
+    }
+    if (end < begin) {
+        return release_range(cb, end, begin - end, page_size);
+    }
+    /* Free space wraps around the end of the buffer (or it is empty). */
+    if (release_range(cb, end, cb->size - end, page_size) < 0) {
+        return -1;
+    }
+    return release_range(cb, 0, begin, page_size);
+}
+
+/* Free space of a mirrored buffer is contiguous, fill it with a single read. */
+static ssize_t mirrored_read(int fd, struct cyclic_buffer* cb, size_t count) {
+    size_t free_space = cyclic_buffer_free_size(cb);
+    ssize_t ret;
+
+    if (!count || !free_space) {
+        return 0;
+    }
+
+    do {
+        ret = read(fd, cb->end, min(free_space, count));
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    cyclic_buffer_produce(cb, cb->end, ret);
+    return ret;
+}
+
 ssize_t cyclic_buffer_read(int fd, struct cyclic_buffer* cb, size_t count) {
+    if (cb->mirrored) {
+        return mirrored_read(fd, cb, count);
+    }
+
     ssize_t got = 0;
     size_t free_space = cyclic_buffer_free_size(cb);
 
@@ -101,7 +312,31 @@ ssize_t cyclic_buffer_read(int fd, struct cyclic_buffer* cb, size_t count) {
     return got;
 }
 
+/* Data in a mirrored buffer is contiguous, drain it with a single write. */
+static ssize_t mirrored_write(int fd, struct cyclic_buffer* cb, size_t count) {
+    size_t available_data = cyclic_buffer_data_size(cb);
+    ssize_t ret;
+
+    if (!count || !available_data) {
+        return 0;
+    }
+
+    do {
+        ret = write(fd, cb->begin, min(available_data, count));
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    cyclic_buffer_consume(cb, ret, available_data);
+    return ret;
+}
+
 ssize_t cyclic_buffer_write(int fd, struct cyclic_buffer* cb, size_t count) {
+    if (cb->mirrored) {
+        return mirrored_write(fd, cb, count);
+    }
+
     ssize_t wrote = 0;
     size_t available_data = cyclic_buffer_data_size(cb);
 
@@ -143,3 +378,62 @@ ssize_t cyclic_buffer_write(int fd, struct cyclic_buffer* cb, size_t count) {
 
     return wrote;
 }
+
+ssize_t cyclic_buffer_readv(int fd, struct cyclic_buffer* cb, size_t count) {
+    size_t len = min(cyclic_buffer_free_size(cb), count);
+    /* `end` is at the end of the buffer only if no data wrapped around yet. */
+    char* end = cb->end == cb->buf + cb->size ? cb->buf : cb->end;
+    size_t first = min(len, cb->buf + cb->size - end);
+    struct iovec iov[2] = {
+        { .iov_base = end, .iov_len = first },
+        { .iov_base = cb->buf, .iov_len = len - first },
+    };
+    ssize_t ret;
+
+    if (!len) {
+        return 0;
+    }
+
+    do {
+        ret = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    cyclic_buffer_produce(cb, end, ret);
+    return ret;
+}
+
+size_t cyclic_buffer_peek(struct cyclic_buffer* cb, size_t count,
+                          struct iovec iov[2]) {
+    size_t len = min(cyclic_buffer_data_size(cb), count);
+    size_t first = min(len, cb->buf + cb->size - cb->begin);
+
+    iov[0].iov_base = cb->begin;
+    iov[0].iov_len = first;
+    iov[1].iov_base = cb->buf;
+    iov[1].iov_len = len - first;
+    return len;
+}
+
+ssize_t cyclic_buffer_writev(int fd, struct cyclic_buffer* cb, size_t count) {
+    size_t available_data = cyclic_buffer_data_size(cb);
+    struct iovec iov[2];
+    size_t len = cyclic_buffer_peek(cb, count, iov);
+    ssize_t ret;
+
+    if (!len) {
+        return 0;
+    }
+
+    do {
+        ret = writev(fd, iov, iov[1].iov_len ? 2 : 1);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    cyclic_buffer_consume(cb, ret, available_data);
+    return ret;
+}
@@ -1,220 +1,1552 @@
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/if_ether.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <threads.h>
+#include <time.h>
 #include <unistd.h>
 
-typedef struct cpu_set_t { unsigned long __bits[128/sizeof(long)]; } cpu_set_t;
-
 #include <liburing.h>
 
 #include "forward.h"
 
-#define QUEUE_DEPTH         8
+/* Submission queue entries needed by a single forwarder. */
+#define QUEUE_DEPTH         32
+/* Number of registered buffers owned by a single forwarder. */
+#define POOL_SIZE           16
+/* Size of the frame length prefix used on the virtio-serial ports. */
+#define HDR_SZ              2
+#define HDR_SZ_32           4
+/* Minimum amount of data read from a length-prefixed stream at once. */
+#define CHUNK_SZ            (64 * 1024)
+/* Leave room in the submission queue for a read, a poll and a timeout. */
+#define MAX_WRITES          (QUEUE_DEPTH - 4)
+/* Maximum number of frames coalesced into a single write to a stream. */
+#define TX_BATCH            (POOL_SIZE / 2)
+/* Maximum time a frame is held back waiting for a batch to fill up. */
+#define TX_FLUSH_NS         (50 * 1000)
+
+/* `user_data` of each SQE: operation type and the forwarder's slot on the
+ * ring in the upper half, pool index and an optional offset into the buffer
+ * in the lower half. */
+#define UDATA_OFF(op, slot, idx, off)                                   \
+    (((uint64_t) (op) << 56) | ((uint64_t) (uint8_t) (slot) << 48)      \
+     | ((uint32_t) (off) << 8) | (uint8_t) (idx))
+#define UDATA(op, slot, idx) UDATA_OFF(op, slot, idx, 0)
+#define UDATA_OP(data)      ((uint8_t) ((data) >> 56))
+#define UDATA_SLOT(data)    ((uint8_t) ((data) >> 48))
+#define UDATA_IDX(data)     ((uint8_t) (data))
+#define UDATA_BOFF(data)    ((uint32_t) (data) >> 8)
+/* Slot of operations which belong to the engine rather than a forwarder. */
+#define ENGINE_SLOT         0xff
+
+/* Fixed files and buffers registered by a forwarder occupy a contiguous range
+ * of the ring's tables, determined by its slot. */
+#define FILES_PER_SLOT      3
+#define FILE_RD(ctx)        ((ctx)->slot * FILES_PER_SLOT)
+#define FILE_WR(ctx)        ((ctx)->slot * FILES_PER_SLOT + 1)
+#define FILE_PIPE(ctx)      ((ctx)->slot * FILES_PER_SLOT + 2)
+#define FILE_WAKE(engine)   ((engine)->len * FILES_PER_SLOT)
+
+/* Capacity of the pipe frames are spliced through. */
+#define PIPE_SZ             (1024 * 1024)
+
+/* Maximum number of forwarders and of forwarding threads. */
+#define FWD_MAX             64
+/* Retry interval bounds while the read side reports a hang-up. */
+#define BACKOFF_MIN_NS      (1000 * 1000)
+#define BACKOFF_MAX_NS      (100 * 1000 * 1000)
+/* Time a stopping thread waits for its writes in flight to finish. */
+#define DRAIN_TIMEOUT_SEC   1
+
+static atomic_bool working = true;
+static bool running = false;
+
+struct fwd_counters {
+    _Atomic uint64_t frames;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t short_reads;
+    _Atomic uint64_t write_retries;
+    _Atomic uint64_t stall_ns;
+    _Atomic uint64_t batches;
+    _Atomic uint64_t batch_frames;
+    _Atomic uint64_t wakeups;
+    _Atomic uint64_t wake_ns_total;
+    _Atomic uint64_t wake_ns_max;
+    _Atomic uint64_t hist[FWD_HIST_LEN];
+    _Atomic uint64_t proto_errors;
+};
+
+static const uint32_t hist_bounds[FWD_HIST_LEN - 1] = FWD_HIST_BOUNDS;
+
+/*
+ * A stream written to by forwarders on different threads, e.g. a port fed by
+ * every queue of a multi-queue tap. Batches of frames must not interleave, so
+ * the stream is owned by one forwarder from the start of a batch until it is
+ * written completely. Threads which failed to take it are woken up once it is
+ * released.
+ */
+struct fwd_sink {
+    int fd;
+    atomic_bool busy;
+    /* Bitmask of engines waiting for the sink. */
+    _Atomic uint64_t waiters;
+};
 
-static int working = true;
-struct timespec sleep_tsc = {
-    .tv_sec = 0,
-    .tv_nsec = 500 * 1000 * 1000
+/*
+ * Rate limit shared by a group of forwarders. Bytes and frames are metered by
+ * a token bucket each, in the form of the generic cell rate algorithm: `tat`
+ * is the time at which the bucket would have been drained at the configured
+ * rate, a frame conforms if that is at most `burst_ns` in the future.
+ */
+struct fwd_shaper {
+    mtx_t lock;
+    atomic_bool enabled;
+    struct fwd_rate rate;
+    uint64_t tat_bytes;
+    uint64_t tat_frames;
 };
 
 struct fwd_args {
+    int id;
     int *fds;
-    uint16_t read_sz;
+    uint32_t read_sz;
+    uint32_t hdr_sz;
     bool read_hdr;
     bool write_hdr;
+    bool splice;
+    /* CPU to run the forwarder on, -1 if not pinned. */
+    int cpu;
+    struct fwd_sink *sink;
+    struct fwd_shaper *shaper;
+    struct fwd_counters counters;
 };
 
+static struct fwd_args *forwarders[FWD_MAX];
+static atomic_int forwarders_len = 0;
+/* Engines are only freed by `fwd_stop`, after every thread has finished, as
+ * threads signal each other's `wake_fd`. */
+static _Atomic(struct fwd_engine *) engines[FWD_MAX];
+static int engines_len = 0;
+
 union b_u16 {
     uint16_t i;
     char b[2];
 };
 
-int fwd(void *data);
+union b_u32 {
+    uint32_t i;
+    char b[4];
+};
 
-int fwd_start(
-    int rfd,
-    int wfd,
-    uint16_t read_sz,
-    char read_hdr,
-    char write_hdr
-) {
+enum fwd_op {
+    FWD_OP_READ = 1,
+    FWD_OP_WRITE,
+    FWD_OP_FRAME_WRITE,
+    FWD_OP_POLL,
+    FWD_OP_TIMEOUT,
+    FWD_OP_FLUSH,
+    FWD_OP_SHAPE,
+    FWD_OP_CANCEL,
+};
+
+/*
+ * A single buffer from the pool.
+ *
+ * When reading packets (tap):
+ * `data` - `hdr_sz` bytes reserved for the length prefix, followed by
+ *          `read_sz` bytes of frame data,
+ * `len` - length of the frame stored in the buffer,
+ * `off` - progress of the operation currently performed on the buffer,
+ *         relative to the first byte transferred by that operation.
+ *
+ * When reading a length-prefixed stream (virtio-serial port), the buffer
+ * holds a chunk of the stream with any number of frames:
+ * `off` - start of the first frame not yet submitted for writing,
+ * `fill` - number of bytes read into the buffer,
+ * `refs` - number of frame writes in flight from this buffer.
+ */
+struct fwd_buf {
+    char *data;
+    uint32_t len;
+    uint32_t off;
+    uint32_t fill;
+    int refs;
+    struct fwd_buf *next;
+};
+
+struct fwd_queue {
+    struct fwd_buf *head;
+    struct fwd_buf *tail;
+};
+
+struct fwd_ctx {
+    struct io_uring *ring;
+    struct fwd_engine *engine;
+    int slot;
+    uint32_t hdr_sz;
+    /* A failed forwarder is left alone, others on the ring keep running. */
+    int err;
+    struct fwd_args *args;
+    char *mem;
+    size_t mem_sz;
+    size_t buf_sz;
+    struct fwd_buf bufs[POOL_SIZE];
+    /* Buffers available for reading. */
+    struct fwd_queue free_q;
+    /* Frames waiting to be written, in the order they were read. */
+    struct fwd_queue write_q;
+    int write_q_len;
+    /* Chunk being read from a length-prefixed stream. */
+    struct fwd_buf *rd_buf;
+    int reads;
+    int writes;
+    /* Reads are suspended until the read side becomes ready again. */
+    bool idle;
+    /* Time when the read side was found ready after being idle. */
+    uint64_t wake_ns;
+    uint64_t backoff_ns;
+    struct __kernel_timespec backoff_ts;
+    /* Time when reads were last held back for lack of buffers. */
+    uint64_t stall_ts;
+    /* Frames being written to a stream with a single vectored write. */
+    struct fwd_buf *tx[TX_BATCH];
+    struct iovec tx_iov[TX_BATCH];
+    int tx_len;
+    /* First frame of the batch not written completely yet. */
+    int tx_first;
+    /* Splice mode: bytes of the batch sitting in the pipe. */
+    size_t tx_piped;
+    int pipe[2];
+    /* Hold frames back to coalesce them, set while traffic is bursty. */
+    bool tx_coalesce;
+    /* Flush deadline state, `tx_gen` tells stale timeouts apart. */
+    bool tx_armed;
+    bool tx_flush;
+    uint8_t tx_gen;
+    struct __kernel_timespec tx_ts;
+    /* Writes are held back until the rate limit allows for more frames. */
+    bool shaped;
+    struct __kernel_timespec shape_ts;
+};
+
+/* A thread multiplexing a number of forwarders on a single ring. */
+struct fwd_engine {
+    struct io_uring ring;
+    struct fwd_ctx *ctxs;
+    int len;
+    int id;
     thrd_t th;
-    int ret, *fds = 0;
+    /* CPUs of the pinned forwarders, the thread may run on any of them.
+     * Empty if none is pinned. */
+    cpu_set_t cpus;
+    /* Signalled when a shared sink this engine waits for is released, or
+     * when forwarding stops. */
+    int wake_fd;
+    uint64_t wake_buf;
+    enum fwd_mode mode;
+    uint64_t busy_poll_ns;
+    /* Adaptive mode: completions are busy-polled for until this time. */
+    uint64_t poll_until;
+};
+
+int fwd(void *data);
+
+static struct fwd_sink *fwd_sink_get(int fd) {
+    struct fwd_sink *sink;
+
+    for (int id = 0; id < atomic_load(&forwarders_len); ++id) {
+        if ((sink = forwarders[id]->sink) && sink->fd == fd) {
+            return sink;
+        }
+    }
+    if ((sink = calloc(1, sizeof(struct fwd_sink)))) {
+        sink->fd = fd;
+    }
+    return sink;
+}
+
+int fwd_add(int rfd, int wfd, uint32_t read_sz, int flags) {
+    int id, *fds = 0;
     struct fwd_args *args = 0;
+    struct stat st;
+
+    /* Frames from a length-prefixed stream are written out as packets */
+    if ((flags & FWD_READ_HDR) && (flags & FWD_WRITE_HDR)) {
+        return -EINVAL;
+    }
+    /* Only packets written to a stream are spliced, see `prep_splice` */
+    if ((flags & FWD_SPLICE)
+            && ((flags & FWD_READ_HDR) || !(flags & FWD_WRITE_HDR))) {
+        return -EINVAL;
+    }
+    /* Sockets and pipes keep references to spliced pages, which would be
+     * overwritten by the next read into the buffer */
+    if ((flags & FWD_SPLICE)
+            && (fstat(wfd, &st) < 0 || !S_ISCHR(st.st_mode))) {
+        return -EINVAL;
+    }
+
+    if (running) {
+        return -EBUSY;
+    }
+    if ((id = atomic_load(&forwarders_len)) >= FWD_MAX) {
+        return -ENOSPC;
+    }
 
     if (!(fds = malloc(2 * sizeof(int)))) {
-        ret = -ENOMEM;
         goto err;
     }
-    if (!(args = malloc(sizeof(struct fwd_args)))) {
-        ret = -ENOMEM;
+    if (!(args = calloc(1, sizeof(struct fwd_args)))) {
+        goto err;
+    }
+    if ((flags & FWD_WRITE_HDR) && !(args->sink = fwd_sink_get(wfd))) {
+        goto err;
+    }
+    if (!(args->shaper = calloc(1, sizeof(struct fwd_shaper)))) {
+        goto err;
+    }
+    if (mtx_init(&args->shaper->lock, mtx_plain) != thrd_success) {
+        free(args->shaper);
         goto err;
     }
 
     fds[0] = rfd;
     fds[1] = wfd;
+    args->id = id;
     args->fds = fds;
     args->read_sz = read_sz;
-    args->read_hdr = read_hdr;
-    args->write_hdr = write_hdr;
-
-    if ((ret = thrd_create(&th, fwd, (void*) args)) != thrd_success) {
-        goto err;
-    }
-    return thrd_detach(th);
+    args->hdr_sz = (flags & FWD_LEN32) ? HDR_SZ_32 : HDR_SZ;
+    args->read_hdr = flags & FWD_READ_HDR;
+    args->write_hdr = flags & FWD_WRITE_HDR;
+    args->splice = flags & FWD_SPLICE;
+    args->cpu = -1;
+    forwarders[id] = args;
+    atomic_store(&forwarders_len, id + 1);
+    return id;
 
 err:
     if (fds) free(fds);
     if (args) free(args);
-    return ret;
+    return -ENOMEM;
+}
+
+static void fwd_engine_free(struct fwd_engine *engine) {
+    if (engine->wake_fd != -1) {
+        close(engine->wake_fd);
+    }
+    free(engine->ctxs);
+    free(engine);
+}
+
+int fwd_run(int threads, enum fwd_mode mode, uint32_t busy_poll_us) {
+    struct fwd_engine *engine;
+    int ret, len = atomic_load(&forwarders_len);
+
+    if (running) {
+        return -EBUSY;
+    }
+    if (threads < 1) {
+        return -EINVAL;
+    }
+    if (threads > len) {
+        threads = len;
+    }
+    if (threads > FWD_MAX) {
+        threads = FWD_MAX;
+    }
+    /* No forwarders, nothing to run */
+    if (threads < 1) {
+        return 0;
+    }
+    running = true;
+
+    /* Pinned forwarders run on the thread for their CPU, others are
+     * distributed round-robin */
+    for (int t = 0; t < threads; ++t) {
+        if (!(engine = calloc(1, sizeof(struct fwd_engine)))) {
+            return -ENOMEM;
+        }
+        if (!(engine->ctxs = calloc(len, sizeof(struct fwd_ctx)))) {
+            free(engine);
+            return -ENOMEM;
+        }
+        engine->id = t;
+        CPU_ZERO(&engine->cpus);
+        if ((engine->wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+            ret = -errno;
+            engine->wake_fd = -1;
+            fwd_engine_free(engine);
+            return ret;
+        }
+        for (int id = 0; id < len; ++id) {
+            struct fwd_args *args = forwarders[id];
+            int cpu = args->cpu >= 0 ? args->cpu : id;
+            if (cpu % threads == t) {
+                engine->ctxs[engine->len++].args = args;
+                if (args->cpu >= 0) {
+                    CPU_SET(args->cpu, &engine->cpus);
+                }
+            }
+        }
+        engine->mode = mode;
+        engine->busy_poll_ns = (uint64_t) busy_poll_us * 1000;
+
+        /* Published first, the thread may wait for a sink right away */
+        atomic_store(&engines[t], engine);
+        if ((ret = thrd_create(&engine->th, fwd, (void*) engine))
+                != thrd_success) {
+            /* Nobody waits for a thread that never ran */
+            atomic_store(&engines[t], 0);
+            fwd_engine_free(engine);
+            return ret == thrd_nomem ? -ENOMEM : -EAGAIN;
+        }
+        engines_len = t + 1;
+    }
+    return 0;
+}
+
+int fwd_set_cpu(int id, int cpu) {
+    if (running || id < 0 || id >= atomic_load(&forwarders_len) || cpu < 0
+            || cpu >= CPU_SETSIZE) {
+        return -EINVAL;
+    }
+    forwarders[id]->cpu = cpu;
+    return 0;
+}
+
+int fwd_share_rate(int id, int leader) {
+    int len = atomic_load(&forwarders_len);
+    struct fwd_shaper *shaper;
+
+    if (running || id < 0 || id >= len || leader < 0 || leader >= len) {
+        return -EINVAL;
+    }
+
+    shaper = forwarders[id]->shaper;
+    forwarders[id]->shaper = forwarders[leader]->shaper;
+    for (int i = 0; i < len; ++i) {
+        if (forwarders[i]->shaper == shaper) {
+            return 0;
+        }
+    }
+    mtx_destroy(&shaper->lock);
+    free(shaper);
+    return 0;
+}
+
+int fwd_set_rate(int id, const struct fwd_rate *rate) {
+    struct fwd_shaper *shaper;
+
+    if (id < 0 || id >= atomic_load(&forwarders_len)) {
+        return -EINVAL;
+    }
+
+    shaper = forwarders[id]->shaper;
+    mtx_lock(&shaper->lock);
+    shaper->rate = *rate;
+    shaper->tat_bytes = shaper->tat_frames = 0;
+    atomic_store(&shaper->enabled,
+                 rate->bytes_per_sec || rate->frames_per_sec);
+    mtx_unlock(&shaper->lock);
+    return 0;
 }
 
 void fwd_stop() {
-    working = false;
+    struct fwd_engine *engine;
+
+    atomic_store(&working, false);
+    for (int t = 0; t < engines_len; ++t) {
+        eventfd_write(atomic_load(&engines[t])->wake_fd, 1);
+    }
+    for (int t = 0; t < engines_len; ++t) {
+        thrd_join(atomic_load(&engines[t])->th, NULL);
+    }
+    for (int t = 0; t < engines_len; ++t) {
+        engine = atomic_exchange(&engines[t], 0);
+        fwd_engine_free(engine);
+    }
+    engines_len = 0;
+}
+
+int fwd_get_stats(int id, struct fwd_stats *stats) {
+    struct fwd_args *args;
+
+    if (id < 0 || id >= FWD_MAX || !(args = forwarders[id])) {
+        return -EINVAL;
+    }
+
+#define LOAD(c) atomic_load_explicit(&args->counters.c, memory_order_relaxed)
+    stats->frames = LOAD(frames);
+    stats->bytes = LOAD(bytes);
+    stats->short_reads = LOAD(short_reads);
+    stats->write_retries = LOAD(write_retries);
+    stats->stall_ns = LOAD(stall_ns);
+    stats->batches = LOAD(batches);
+    stats->batch_frames = LOAD(batch_frames);
+    stats->wakeups = LOAD(wakeups);
+    stats->wake_ns_total = LOAD(wake_ns_total);
+    stats->wake_ns_max = LOAD(wake_ns_max);
+    for (int i = 0; i < FWD_HIST_LEN; ++i) {
+        stats->hist[i] = LOAD(hist[i]);
+    }
+    stats->proto_errors = LOAD(proto_errors);
+#undef LOAD
+    return 0;
+}
+
+/* Counters are written by the owning thread only, so a plain load and store
+ * is enough to keep them consistent for concurrent readers. */
+static void counter_add(_Atomic uint64_t *c, uint64_t v) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v,
+                          memory_order_relaxed);
+}
+
+static void counter_max(_Atomic uint64_t *c, uint64_t v) {
+    if (atomic_load_explicit(c, memory_order_relaxed) < v) {
+        atomic_store_explicit(c, v, memory_order_relaxed);
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-int read_fd(
-    struct io_uring *ring,
-    int fd,
-    char *dst,
-    uint16_t count,
-    char exact
-) {
+/* Time to wait until the bucket allows for `cost` more [ns], 0 if it does. */
+static uint64_t bucket_wait(uint64_t *tat, uint64_t cost, uint64_t burst_ns,
+                            uint64_t now) {
+    uint64_t t = *tat > now ? *tat : now;
+
+    if (t - now > burst_ns) {
+        return t - now - burst_ns;
+    }
+    *tat = t + cost;
+    return 0;
+}
+
+/*
+ * Takes a frame of `len` bytes from the buckets. Returns the time to wait for
+ * the rate limit to allow for it [ns], 0 if the frame can be written now.
+ */
+static uint64_t shaper_admit(struct fwd_shaper *shaper, uint32_t len) {
+    uint64_t wait = 0, now, burst_ns, tat_bytes;
+    struct fwd_rate *rate = &shaper->rate;
+
+    if (!atomic_load_explicit(&shaper->enabled, memory_order_relaxed)) {
+        return 0;
+    }
+
+    now = now_ns();
+    mtx_lock(&shaper->lock);
+    burst_ns = (uint64_t) rate->burst_us * 1000;
+    tat_bytes = shaper->tat_bytes;
+    if (rate->bytes_per_sec) {
+        wait = bucket_wait(&shaper->tat_bytes,
+                           (uint64_t) len * 1000000000 / rate->bytes_per_sec,
+                           burst_ns, now);
+    }
+    if (!wait && rate->frames_per_sec) {
+        if ((wait = bucket_wait(&shaper->tat_frames,
+                                1000000000 / rate->frames_per_sec,
+                                burst_ns, now))) {
+            /* Give the bytes back, the frame is not written after all */
+            shaper->tat_bytes = tat_bytes;
+        }
+    }
+    mtx_unlock(&shaper->lock);
+    return wait;
+}
+
+/* Account for a frame which has been written out completely. */
+static void count_frame(struct fwd_ctx *ctx, uint32_t len) {
+    struct fwd_counters *c = &ctx->args->counters;
+    int i = 0;
+
+    while (i < FWD_HIST_LEN - 1 && len > hist_bounds[i]) {
+        ++i;
+    }
+    counter_add(&c->frames, 1);
+    counter_add(&c->bytes, len);
+    counter_add(&c->hist[i], 1);
+}
+
+static void queue_push(struct fwd_queue *q, struct fwd_buf *b) {
+    b->next = 0;
+    if (q->tail) {
+        q->tail->next = b;
+    } else {
+        q->head = b;
+    }
+    q->tail = b;
+}
+
+static struct fwd_buf *queue_pop(struct fwd_queue *q) {
+    struct fwd_buf *b = q->head;
+    if (b) {
+        q->head = b->next;
+        if (!q->head) {
+            q->tail = 0;
+        }
+        b->next = 0;
+    }
+    return b;
+}
+
+static int buf_idx(struct fwd_ctx *ctx, struct fwd_buf *b) {
+    return b - ctx->bufs;
+}
+
+/* Index of the buffer in the ring's table of registered buffers. */
+static int buf_reg(struct fwd_ctx *ctx, struct fwd_buf *b) {
+    return ctx->slot * POOL_SIZE + buf_idx(ctx, b);
+}
+
+static int fwd_ctx_init(struct fwd_ctx *ctx, struct fwd_engine *engine,
+                        int slot, struct iovec *iov) {
+    struct fwd_args *args = ctx->args;
+    size_t buf_sz;
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->ring = &engine->ring;
+    ctx->engine = engine;
+    ctx->slot = slot;
+    ctx->hdr_sz = args->hdr_sz;
+    ctx->args = args;
+    ctx->mem = MAP_FAILED;
+    ctx->pipe[0] = ctx->pipe[1] = -1;
+
+    buf_sz = ctx->hdr_sz + args->read_sz;
+    if (args->read_hdr && buf_sz < CHUNK_SZ) {
+        buf_sz = CHUNK_SZ;
+    }
+    /* Keep every buffer 64-byte aligned */
+    buf_sz = (buf_sz + 63) & ~((size_t) 63);
+    ctx->buf_sz = buf_sz;
+    ctx->mem_sz = buf_sz * POOL_SIZE;
+    ctx->mem = mmap(NULL, ctx->mem_sz, PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ctx->mem == MAP_FAILED) {
+        return -ENOMEM;
+    }
+
+    for (int i = 0; i < POOL_SIZE; ++i) {
+        ctx->bufs[i].data = ctx->mem + i * buf_sz;
+        iov[i].iov_base = ctx->bufs[i].data;
+        iov[i].iov_len = buf_sz;
+        queue_push(&ctx->free_q, &ctx->bufs[i]);
+    }
+
+    if (args->splice) {
+        if (pipe2(ctx->pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+            return -errno;
+        }
+        /* Best effort, a frame larger than the pipe is spliced in parts */
+        fcntl(ctx->pipe[1], F_SETPIPE_SZ, PIPE_SZ);
+    }
+    return 0;
+}
+
+static void fwd_ctx_deinit(struct fwd_ctx *ctx) {
+    if (ctx->mem != MAP_FAILED) {
+        munmap(ctx->mem, ctx->mem_sz);
+    }
+    if (ctx->pipe[0] != -1) {
+        close(ctx->pipe[0]);
+        close(ctx->pipe[1]);
+    }
+}
+
+static int fwd_ring_init(struct fwd_engine *engine) {
+    struct io_uring_params params;
+    unsigned entries = QUEUE_DEPTH * engine->len;
+    int ret;
+
+    memset(&params, 0, sizeof(params));
+    if (engine->mode == FWD_MODE_SQPOLL) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = engine->busy_poll_ns / 1000000 + 1;
+    }
+
+    ret = io_uring_queue_init_params(entries, &engine->ring, &params);
+    if (ret < 0 && engine->mode == FWD_MODE_SQPOLL) {
+        /* SQPOLL may not be permitted, stay functional without it */
+        engine->mode = FWD_MODE_BLOCKING;
+        memset(&params, 0, sizeof(params));
+        ret = io_uring_queue_init_params(entries, &engine->ring, &params);
+    }
+    return ret;
+}
+
+static int fwd_engine_init(struct fwd_engine *engine) {
+    struct iovec *iov = 0;
+    int *fds = 0;
+    int ret = -ENOMEM;
+
+    for (int i = 0; i < engine->len; ++i) {
+        engine->ctxs[i].mem = MAP_FAILED;
+        engine->ctxs[i].pipe[0] = engine->ctxs[i].pipe[1] = -1;
+    }
+
+    if (!(iov = calloc(engine->len * POOL_SIZE, sizeof(struct iovec)))) {
+        goto end;
+    }
+    if (!(fds = calloc(engine->len * FILES_PER_SLOT + 1, sizeof(int)))) {
+        goto end;
+    }
+    fds[FILE_WAKE(engine)] = engine->wake_fd;
+
+    for (int i = 0; i < engine->len; ++i) {
+        struct fwd_ctx *ctx = &engine->ctxs[i];
+        if ((ret = fwd_ctx_init(ctx, engine, i, iov + i * POOL_SIZE)) < 0) {
+            goto end;
+        }
+        fds[FILE_RD(ctx)] = ctx->args->fds[0];
+        fds[FILE_WR(ctx)] = ctx->args->fds[1];
+        fds[FILE_PIPE(ctx)] = ctx->pipe[0];
+    }
+
+    if ((ret = fwd_ring_init(engine)) < 0) {
+        goto end;
+    }
+    if ((ret = io_uring_register_files(&engine->ring, fds,
+                                       engine->len * FILES_PER_SLOT + 1)) < 0) {
+        goto end;
+    }
+    ret = io_uring_register_buffers(&engine->ring, iov,
+                                    engine->len * POOL_SIZE);
+
+end:
+    if (iov) free(iov);
+    if (fds) free(fds);
+    return ret;
+}
+
+static void fwd_engine_deinit(struct fwd_engine *engine) {
+    if (engine->ring.ring_fd > 0) {
+        io_uring_unregister_buffers(&engine->ring);
+        io_uring_unregister_files(&engine->ring);
+        io_uring_queue_exit(&engine->ring);
+    }
+    for (int i = 0; i < engine->len; ++i) {
+        fwd_ctx_deinit(&engine->ctxs[i]);
+    }
+}
+
+static int prep_wake(struct fwd_engine *engine) {
     struct io_uring_sqe *sqe;
-    struct io_uring_cqe *cqe;
 
-    int ret = 0;
-    uint16_t rc = 0;
-    uint16_t ro = 0;
+    if (!(sqe = io_uring_get_sqe(&engine->ring))) {
+        return -EBUSY;
+    }
 
-    while (working && ro < count) {
-        if (!(sqe = io_uring_get_sqe(ring))) {
-            return -1;
+    io_uring_prep_read(sqe, FILE_WAKE(engine), &engine->wake_buf,
+                       sizeof(engine->wake_buf), 0);
+    sqe->user_data = UDATA(FWD_OP_READ, ENGINE_SLOT, 0);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    return 0;
+}
+
+static void fwd_pin(struct fwd_engine *engine) {
+    if (!CPU_COUNT(&engine->cpus)) {
+        return;
+    }
+    /* Not fatal, the forwarder works unpinned as well */
+    sched_setaffinity(0, sizeof(engine->cpus), &engine->cpus);
+}
+
+static bool sink_acquire(struct fwd_ctx *ctx) {
+    struct fwd_sink *sink = ctx->args->sink;
+    uint64_t bit = (uint64_t) 1 << ctx->engine->id;
+
+    if (!atomic_exchange(&sink->busy, true)) {
+        return true;
+    }
+    atomic_fetch_or(&sink->waiters, bit);
+    /* The sink may have been released before the bit was set */
+    if (!atomic_exchange(&sink->busy, true)) {
+        atomic_fetch_and(&sink->waiters, ~bit);
+        return true;
+    }
+    return false;
+}
+
+static void sink_release(struct fwd_ctx *ctx) {
+    struct fwd_sink *sink = ctx->args->sink;
+    struct fwd_engine *engine;
+    uint64_t waiters;
+
+    atomic_store(&sink->busy, false);
+    waiters = atomic_exchange(&sink->waiters, 0);
+    for (int t = 0; waiters; ++t, waiters >>= 1) {
+        if ((waiters & 1) && (engine = atomic_load(&engines[t]))) {
+            eventfd_write(engine->wake_fd, 1);
         }
+    }
+}
+
+static int prep_read(struct fwd_ctx *ctx, struct fwd_buf *b) {
+    struct io_uring_sqe *sqe;
+    char *dst;
+    uint32_t count;
+
+    if (!(sqe = io_uring_get_sqe(ctx->ring))) {
+        return -EBUSY;
+    }
+
+    if (ctx->args->read_hdr) {
+        dst = b->data + b->fill;
+        count = ctx->buf_sz - b->fill;
+    } else {
+        dst = b->data + ctx->hdr_sz;
+        count = ctx->args->read_sz;
+    }
+
+    io_uring_prep_read_fixed(sqe, FILE_RD(ctx), dst, count, 0,
+                             buf_reg(ctx, b));
+    sqe->user_data = UDATA(FWD_OP_READ, ctx->slot, buf_idx(ctx, b));
+    sqe->flags |= IOSQE_FIXED_FILE;
+
+    ctx->reads++;
+    return 0;
+}
+
+static int prep_write(struct fwd_ctx *ctx, struct fwd_buf *b) {
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = io_uring_get_sqe(ctx->ring))) {
+        return -EBUSY;
+    }
 
-        io_uring_prep_read(sqe, fd, dst + ro, count - ro, 0);
-        sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_prep_write_fixed(sqe, FILE_WR(ctx),
+                              b->data + ctx->hdr_sz + b->off,
+                              b->len - b->off, 0, buf_reg(ctx, b));
+    sqe->user_data = UDATA(FWD_OP_WRITE, ctx->slot, buf_idx(ctx, b));
+    sqe->flags |= IOSQE_FIXED_FILE;
 
-        io_uring_submit(ring);
-        if ((ret = io_uring_wait_cqe(ring, &cqe)) < 0) {
+    ctx->writes++;
+    return 0;
+}
+
+/* Write the remainder of the current batch of length-prefixed frames. */
+static int prep_writev(struct fwd_ctx *ctx) {
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = io_uring_get_sqe(ctx->ring))) {
+        return -EBUSY;
+    }
+
+    io_uring_prep_writev(sqe, FILE_WR(ctx), ctx->tx_iov + ctx->tx_first,
+                         ctx->tx_len - ctx->tx_first, 0);
+    sqe->user_data = UDATA(FWD_OP_WRITE, ctx->slot, 0);
+    sqe->flags |= IOSQE_FIXED_FILE;
+
+    ctx->writes++;
+    return 0;
+}
+
+/* Skip `n` bytes of the current batch. */
+static void tx_advance(struct fwd_ctx *ctx, size_t n) {
+    struct iovec *iov;
+    size_t len;
+
+    while (n > 0 && ctx->tx_first < ctx->tx_len) {
+        iov = &ctx->tx_iov[ctx->tx_first];
+        len = n < iov->iov_len ? n : iov->iov_len;
+        iov->iov_base = (char *) iov->iov_base + len;
+        iov->iov_len -= len;
+        n -= len;
+        if (!iov->iov_len) {
+            ctx->tx_first++;
+        }
+    }
+}
+
+/*
+ * Splice mode: map the batch into a pipe with vmsplice(2) and splice it from
+ * there to the sink. Linux 5.10 implements splice_write for virtio-serial
+ * ports but neither splice_read for them nor splice for taps, hence only the
+ * tap to port direction can use it.
+ *
+ * The pages are not gifted, so the port cannot steal them and copies them
+ * out of the pipe, as a write copies them from user space. Once the pipe has
+ * been drained, nothing refers to them anymore and the buffers are reused
+ * like after a write.
+ */
+static int prep_splice(struct fwd_ctx *ctx) {
+    struct io_uring_sqe *sqe;
+    ssize_t n;
+
+    if (ctx->tx_first < ctx->tx_len) {
+        n = vmsplice(ctx->pipe[1], ctx->tx_iov + ctx->tx_first,
+                     ctx->tx_len - ctx->tx_first, SPLICE_F_NONBLOCK);
+        if (n < 0 && errno != EAGAIN) {
+            return -errno;
+        }
+        if (n > 0) {
+            tx_advance(ctx, n);
+            ctx->tx_piped += n;
+        }
+    }
+
+    if (!(sqe = io_uring_get_sqe(ctx->ring))) {
+        return -EBUSY;
+    }
+
+    io_uring_prep_splice(sqe, FILE_PIPE(ctx), -1, FILE_WR(ctx), -1,
+                         ctx->tx_piped, SPLICE_F_FD_IN_FIXED | SPLICE_F_MOVE);
+    sqe->user_data = UDATA(FWD_OP_WRITE, ctx->slot, 0);
+    sqe->flags |= IOSQE_FIXED_FILE;
+
+    ctx->writes++;
+    return 0;
+}
+
+static uint32_t frame_len(struct fwd_ctx *ctx, struct fwd_buf *b,
+                          uint32_t off) {
+    if (ctx->hdr_sz == HDR_SZ_32) {
+        union b_u32 sz;
+        memcpy(sz.b, b->data + off, sizeof(sz.b));
+        return sz.i;
+    }
+
+    union b_u16 sz;
+    memcpy(sz.b, b->data + off, sizeof(sz.b));
+    return sz.i;
+}
+
+static void frame_set_len(struct fwd_ctx *ctx, struct fwd_buf *b) {
+    if (ctx->hdr_sz == HDR_SZ_32) {
+        union b_u32 sz = { .i = b->len };
+        memcpy(b->data, sz.b, sizeof(sz.b));
+    } else {
+        union b_u16 sz = { .i = b->len };
+        memcpy(b->data, sz.b, sizeof(sz.b));
+    }
+}
+
+/* Write a single frame directly from a stream chunk, skipping its prefix. */
+static int prep_frame_write(struct fwd_ctx *ctx, struct fwd_buf *b,
+                            uint32_t off) {
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = io_uring_get_sqe(ctx->ring))) {
+        return -EBUSY;
+    }
+
+    io_uring_prep_write_fixed(sqe, FILE_WR(ctx), b->data + off + ctx->hdr_sz,
+                              frame_len(ctx, b, off), 0, buf_reg(ctx, b));
+    sqe->user_data = UDATA_OFF(FWD_OP_FRAME_WRITE, ctx->slot,
+                               buf_idx(ctx, b), off);
+    sqe->flags |= IOSQE_FIXED_FILE;
+
+    b->refs++;
+    ctx->writes++;
+    return 0;
+}
+
+/* Wait for the read side to become readable instead of spinning on it. */
+static int prep_poll(struct fwd_ctx *ctx) {
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = io_uring_get_sqe(ctx->ring))) {
+        return -EBUSY;
+    }
+
+    io_uring_prep_poll_add(sqe, FILE_RD(ctx), POLLIN);
+    sqe->user_data = UDATA(FWD_OP_POLL, ctx->slot, 0);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    return 0;
+}
+
+static int prep_timeout(struct fwd_ctx *ctx, struct __kernel_timespec *ts,
+                        uint64_t ns, uint64_t user_data) {
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = io_uring_get_sqe(ctx->ring))) {
+        return -EBUSY;
+    }
+
+    ts->tv_sec = ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+    io_uring_prep_timeout(sqe, ts, 0, 0);
+    sqe->user_data = user_data;
+    return 0;
+}
+
+/*
+ * Reads from a byte stream have to be issued one at a time. Keep appending to
+ * the current chunk until the frame at its end no longer fits, then carry the
+ * partial frame over to a fresh buffer.
+ */
+static int queue_chunk_read(struct fwd_ctx *ctx) {
+    struct fwd_buf *b = ctx->rd_buf, *next;
+    uint32_t need = ctx->hdr_sz;
+
+    if (ctx->reads) {
+        return 0;
+    }
+    if (!b && !(b = ctx->rd_buf = queue_pop(&ctx->free_q))) {
+        return 0;
+    }
+
+    if (b->off == b->fill && !b->refs) {
+        b->off = b->fill = 0;
+    }
+    if (b->fill - b->off >= ctx->hdr_sz) {
+        need += frame_len(ctx, b, b->off);
+    }
+
+    if (b->off + need > ctx->buf_sz) {
+        if (!(next = queue_pop(&ctx->free_q))) {
+            return 0;
+        }
+        next->off = 0;
+        next->fill = b->fill - b->off;
+        memcpy(next->data, b->data + b->off, next->fill);
+
+        b->off = b->fill;
+        if (!b->refs) {
+            queue_push(&ctx->free_q, b);
+        }
+        ctx->rd_buf = b = next;
+    } else if (b->fill == ctx->buf_sz) {
+        /* Complete frames are still waiting to be written */
+        return 0;
+    }
+
+    return prep_read(ctx, b);
+}
+
+static int queue_reads(struct fwd_ctx *ctx) {
+    struct fwd_buf *b;
+    int ret;
+
+    if (ctx->idle) {
+        return 0;
+    }
+
+    if (ctx->args->read_hdr) {
+        return queue_chunk_read(ctx);
+    }
+
+    while ((b = queue_pop(&ctx->free_q))) {
+        if ((ret = prep_read(ctx, b)) < 0) {
+            queue_push(&ctx->free_q, b);
             return ret;
         }
+    }
+    return 0;
+}
 
-        rc = cqe->res;
-        io_uring_cqe_seen(ring, cqe);
-        if (rc <= 0) {
-            thrd_sleep(&sleep_tsc, 0);
-            continue;
+/* Hold writes back for `ns` to stay within the rate limit. */
+static int shape(struct fwd_ctx *ctx, uint64_t ns) {
+    ctx->shaped = true;
+    return prep_timeout(ctx, &ctx->shape_ts, ns,
+                        UDATA(FWD_OP_SHAPE, ctx->slot, 0));
+}
+
+/* Submit every complete frame of the current stream chunk. */
+static int queue_frames(struct fwd_ctx *ctx) {
+    struct fwd_buf *b = ctx->rd_buf;
+    uint64_t wait;
+    uint32_t len;
+    int ret;
+
+    while (b && ctx->writes < MAX_WRITES && b->fill - b->off >= ctx->hdr_sz) {
+        if ((len = frame_len(ctx, b, b->off)) > ctx->args->read_sz) {
+            fprintf(stderr, "Forwarder %d: frame length %u exceeds %u\n",
+                    ctx->args->id, len, ctx->args->read_sz);
+            counter_add(&ctx->args->counters.proto_errors, 1);
+            return -EPROTO;
+        }
+        if (b->fill - b->off < ctx->hdr_sz + len) {
+            break;
+        }
+        if (len && (wait = shaper_admit(ctx->args->shaper, len))) {
+            return shape(ctx, wait);
+        }
+        if (len && (ret = prep_frame_write(ctx, b, b->off)) < 0) {
+            return ret;
+        }
+        b->off += ctx->hdr_sz + len;
+    }
+    return 0;
+}
+
+/*
+ * Frames written into a byte stream must not interleave, so only a single
+ * batch is in flight at a time. Frames read in the meantime make up the next
+ * batch. While traffic is bursty, a batch which is not full is held back for
+ * at most `TX_FLUSH_NS` to let more frames arrive.
+ */
+static int queue_batch(struct fwd_ctx *ctx) {
+    struct fwd_buf *b;
+    uint64_t wait = 0;
+
+    if (ctx->writes || !ctx->write_q_len) {
+        return 0;
+    }
+
+    if (ctx->write_q_len < TX_BATCH && ctx->tx_coalesce && !ctx->tx_flush) {
+        if (ctx->tx_armed) {
+            return 0;
         }
-        ro += rc;
+        ctx->tx_armed = true;
+        return prep_timeout(ctx, &ctx->tx_ts, TX_FLUSH_NS,
+                            UDATA(FWD_OP_FLUSH, ctx->slot, ctx->tx_gen));
+    }
 
-        if (!exact) {
+    if (!sink_acquire(ctx)) {
+        return 0;
+    }
+
+    ctx->tx_first = 0;
+    for (ctx->tx_len = 0; ctx->tx_len < TX_BATCH; ++ctx->tx_len) {
+        if (!(b = ctx->write_q.head)
+                || (wait = shaper_admit(ctx->args->shaper, b->len))) {
             break;
         }
+        queue_pop(&ctx->write_q);
+        ctx->write_q_len--;
+
+        frame_set_len(ctx, b);
+        ctx->tx[ctx->tx_len] = b;
+        ctx->tx_iov[ctx->tx_len].iov_base = b->data;
+        ctx->tx_iov[ctx->tx_len].iov_len = ctx->hdr_sz + b->len;
+    }
+    if (!ctx->tx_len) {
+        sink_release(ctx);
+        return shape(ctx, wait);
     }
 
-    return ro;
+    ctx->tx_flush = false;
+    /* A timer still pending belongs to this batch, the next one needs its own
+     * to keep within `TX_FLUSH_NS`. */
+    ctx->tx_armed = false;
+    ctx->tx_gen++;
+    if (ctx->args->splice) {
+        return prep_splice(ctx);
+    }
+    return prep_writev(ctx);
 }
 
-int write_fd(
-    struct io_uring *ring,
-    int fd,
-    char *src,
-    uint16_t count
-) {
-    struct io_uring_sqe *sqe;
-    struct io_uring_cqe *cqe;
+static int queue_writes(struct fwd_ctx *ctx) {
+    struct fwd_buf *b;
+    uint64_t wait;
+    int ret;
+
+    if (ctx->shaped) {
+        return 0;
+    }
+    if (ctx->args->read_hdr) {
+        return queue_frames(ctx);
+    }
+    if (ctx->args->write_hdr) {
+        return queue_batch(ctx);
+    }
+
+    while ((b = ctx->write_q.head)) {
+        if ((wait = shaper_admit(ctx->args->shaper, b->len))) {
+            return shape(ctx, wait);
+        }
+        queue_pop(&ctx->write_q);
+        ctx->write_q_len--;
+        if ((ret = prep_write(ctx, b)) < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
 
-    int ret = 0;
-    int wc = 0;
-    size_t wo = 0;
+static int handle_read(struct fwd_ctx *ctx, struct fwd_buf *b, int res) {
+    ctx->reads--;
 
-    while (working && wo < count) {
-        if (!(sqe = io_uring_get_sqe(ring))) {
-            return -1;
+    if (res <= 0) {
+        if (res < 0 && res != -EAGAIN && res != -EINTR) {
+            return res;
+        }
+        counter_add(&ctx->args->counters.short_reads, 1);
+        if (!ctx->args->read_hdr) {
+            queue_push(&ctx->free_q, b);
         }
+        if (ctx->idle) {
+            return 0;
+        }
+        ctx->idle = true;
+        return prep_poll(ctx);
+    }
 
-        io_uring_prep_write(sqe, fd, src + wo, count - wo, 0);
-        sqe->flags |= IOSQE_FIXED_FILE;
+    ctx->backoff_ns = 0;
+    if (ctx->wake_ns) {
+        uint64_t lat = now_ns() - ctx->wake_ns;
+        counter_add(&ctx->args->counters.wakeups, 1);
+        counter_add(&ctx->args->counters.wake_ns_total, lat);
+        counter_max(&ctx->args->counters.wake_ns_max, lat);
+        ctx->wake_ns = 0;
+    }
 
-        io_uring_submit(ring);
-        if ((ret = io_uring_wait_cqe(ring, &cqe)) < 0) {
-            return ret;
+    if (ctx->args->read_hdr) {
+        if (b->fill + res < ctx->buf_sz) {
+            counter_add(&ctx->args->counters.short_reads, 1);
+        }
+        b->fill += res;
+        return 0;
+    }
+
+    b->len = res;
+    b->off = 0;
+    queue_push(&ctx->write_q, b);
+    ctx->write_q_len++;
+    return 0;
+}
+
+static int handle_write(struct fwd_ctx *ctx, struct fwd_buf *b, int res) {
+    ctx->writes--;
+
+    if (res < 0) {
+        if (res != -EAGAIN && res != -EINTR) {
+            return res;
+        }
+        counter_add(&ctx->args->counters.write_retries, 1);
+        return prep_write(ctx, b);
+    }
+
+    b->off += res;
+    if (b->off < b->len) {
+        counter_add(&ctx->args->counters.write_retries, 1);
+        return prep_write(ctx, b);
+    }
+
+    count_frame(ctx, b->len);
+    b->off = 0;
+    queue_push(&ctx->free_q, b);
+    return 0;
+}
+
+static void count_batch(struct fwd_ctx *ctx) {
+    counter_add(&ctx->args->counters.batches, 1);
+    counter_add(&ctx->args->counters.batch_frames, ctx->tx_len);
+    for (int i = 0; i < ctx->tx_len; ++i) {
+        count_frame(ctx, ctx->tx[i]->len);
+    }
+}
+
+static int handle_splice(struct fwd_ctx *ctx, int res) {
+    ctx->writes--;
+
+    if (res < 0) {
+        if (res != -EAGAIN && res != -EINTR) {
+            return res;
         }
+        counter_add(&ctx->args->counters.write_retries, 1);
+        return prep_splice(ctx);
+    }
+
+    ctx->tx_piped -= res;
+    if (ctx->tx_piped || ctx->tx_first < ctx->tx_len) {
+        counter_add(&ctx->args->counters.write_retries, 1);
+        return prep_splice(ctx);
+    }
 
-        wc = cqe->res;
-        io_uring_cqe_seen(ring, cqe);
-        if (wc < 0) {
-            return -2;
+    count_batch(ctx);
+    for (int i = 0; i < ctx->tx_len; ++i) {
+        queue_push(&ctx->free_q, ctx->tx[i]);
+    }
+    ctx->tx_coalesce = ctx->tx_len > 1;
+    ctx->tx_len = 0;
+    sink_release(ctx);
+    return 0;
+}
+
+static int handle_writev(struct fwd_ctx *ctx, int res) {
+    ctx->writes--;
+
+    if (res < 0) {
+        if (res != -EAGAIN && res != -EINTR) {
+            return res;
         }
-        wo += wc;
+        counter_add(&ctx->args->counters.write_retries, 1);
+        return prep_writev(ctx);
     }
 
+    /* Virtio-serial ports accept at most 32 KiB in a single write */
+    tx_advance(ctx, res);
+    if (ctx->tx_first < ctx->tx_len) {
+        counter_add(&ctx->args->counters.write_retries, 1);
+        return prep_writev(ctx);
+    }
+
+    count_batch(ctx);
+    for (int i = 0; i < ctx->tx_len; ++i) {
+        queue_push(&ctx->free_q, ctx->tx[i]);
+    }
+    ctx->tx_coalesce = ctx->tx_len > 1;
+    ctx->tx_len = 0;
+    sink_release(ctx);
     return 0;
 }
 
+static void handle_flush(struct fwd_ctx *ctx, uint8_t gen) {
+    if (gen == ctx->tx_gen) {
+        ctx->tx_armed = false;
+        ctx->tx_flush = true;
+    }
+}
+
+static int handle_frame_write(struct fwd_ctx *ctx, struct fwd_buf *b,
+                              uint32_t off, int res) {
+    ctx->writes--;
+    b->refs--;
+
+    if (res < 0) {
+        if (res != -EAGAIN && res != -EINTR) {
+            return res;
+        }
+        counter_add(&ctx->args->counters.write_retries, 1);
+        return prep_frame_write(ctx, b, off);
+    }
+
+    count_frame(ctx, res);
+    /* Packets are written whole, the chunk is done once all frames are */
+    if (!b->refs && b != ctx->rd_buf) {
+        queue_push(&ctx->free_q, b);
+    }
+    return 0;
+}
+
+static int handle_poll(struct fwd_ctx *ctx, int res) {
+    if (res > 0 && !(res & POLLIN) && (res & (POLLHUP | POLLERR))) {
+        /* The other end is gone (e.g. the host side of a virtio-serial port
+         * is not connected) and the poll would complete immediately again */
+        ctx->backoff_ns = ctx->backoff_ns
+            ? ctx->backoff_ns * 2
+            : BACKOFF_MIN_NS;
+        if (ctx->backoff_ns > BACKOFF_MAX_NS) {
+            ctx->backoff_ns = BACKOFF_MAX_NS;
+        }
+        return prep_timeout(ctx, &ctx->backoff_ts, ctx->backoff_ns,
+                            UDATA(FWD_OP_TIMEOUT, ctx->slot, 0));
+    }
+
+    ctx->idle = false;
+    ctx->wake_ns = now_ns();
+    return 0;
+}
+
+static int handle_cqe(struct fwd_ctx *ctx, struct io_uring_cqe *cqe) {
+    uint8_t idx = UDATA_IDX(cqe->user_data);
+
+    switch (UDATA_OP(cqe->user_data)) {
+        case FWD_OP_READ:
+            return handle_read(ctx, &ctx->bufs[idx], cqe->res);
+        case FWD_OP_WRITE:
+            if (ctx->args->splice) {
+                return handle_splice(ctx, cqe->res);
+            }
+            if (ctx->args->write_hdr) {
+                return handle_writev(ctx, cqe->res);
+            }
+            return handle_write(ctx, &ctx->bufs[idx], cqe->res);
+        case FWD_OP_FRAME_WRITE:
+            return handle_frame_write(ctx, &ctx->bufs[idx],
+                                      UDATA_BOFF(cqe->user_data), cqe->res);
+        case FWD_OP_POLL:
+            return handle_poll(ctx, cqe->res);
+        case FWD_OP_TIMEOUT:
+            ctx->idle = false;
+            return 0;
+        case FWD_OP_FLUSH:
+            handle_flush(ctx, idx);
+            return 0;
+        case FWD_OP_SHAPE:
+            ctx->shaped = false;
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+/*
+ * Lets other forwarders have the stream once no write of the current batch is
+ * in flight anymore, so that their frames do not interleave with it. The batch
+ * itself is given up.
+ */
+static void fwd_ctx_release(struct fwd_ctx *ctx) {
+    if (ctx->tx_len && !ctx->writes) {
+        ctx->tx_len = 0;
+        sink_release(ctx);
+    }
+}
+
+static void fwd_ctx_fail(struct fwd_ctx *ctx, int err) {
+    fprintf(stderr, "Forwarder %d stopped: %s\n", ctx->args->id,
+            strerror(-err));
+    ctx->err = err;
+    fwd_ctx_release(ctx);
+}
+
+/* Completions of a failed forwarder only matter for releasing the sink. */
+static void fwd_ctx_reap(struct fwd_ctx *ctx, struct io_uring_cqe *cqe) {
+    if (UDATA_OP(cqe->user_data) == FWD_OP_WRITE) {
+        ctx->writes--;
+        fwd_ctx_release(ctx);
+    }
+}
+
+/*
+ * Cancels the batches in flight when the thread stops and waits for them to
+ * complete, to release the sinks they hold. A write which does not complete
+ * in time keeps its sink.
+ */
+static void fwd_engine_drain(struct fwd_engine *engine) {
+    struct __kernel_timespec ts = { .tv_sec = DRAIN_TIMEOUT_SEC };
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct fwd_ctx *ctx;
+    bool busy;
+
+    if (engine->ring.ring_fd <= 0) {
+        return;
+    }
+
+    for (int i = 0; i < engine->len; ++i) {
+        ctx = &engine->ctxs[i];
+        if (ctx->tx_len && ctx->writes
+                && (sqe = io_uring_get_sqe(&engine->ring))) {
+            io_uring_prep_cancel(sqe, (void *) (uintptr_t)
+                                 UDATA(FWD_OP_WRITE, ctx->slot, 0), 0);
+            sqe->user_data = UDATA(FWD_OP_CANCEL, ENGINE_SLOT, 0);
+        }
+    }
+    io_uring_submit(&engine->ring);
+
+    while (true) {
+        busy = false;
+        for (int i = 0; i < engine->len; ++i) {
+            ctx = &engine->ctxs[i];
+            fwd_ctx_release(ctx);
+            busy |= ctx->tx_len != 0;
+        }
+        if (!busy || io_uring_wait_cqe_timeout(&engine->ring, &cqe, &ts) < 0) {
+            return;
+        }
+        if (UDATA_SLOT(cqe->user_data) < engine->len) {
+            fwd_ctx_reap(&engine->ctxs[UDATA_SLOT(cqe->user_data)], cqe);
+        }
+        io_uring_cqe_seen(&engine->ring, cqe);
+    }
+}
+
+static int fwd_ctx_queue(struct fwd_ctx *ctx) {
+    int ret;
+
+    if ((ret = queue_reads(ctx)) < 0) {
+        return ret;
+    }
+
+    /* Nothing to read into until the write side catches up */
+    if (!ctx->idle && !ctx->reads) {
+        if (!ctx->stall_ts) {
+            ctx->stall_ts = now_ns();
+        }
+    } else if (ctx->stall_ts) {
+        counter_add(&ctx->args->counters.stall_ns, now_ns() - ctx->stall_ts);
+        ctx->stall_ts = 0;
+    }
+
+    return queue_writes(ctx);
+}
 
 int fwd(void *data) {
-    struct io_uring ring;
-    struct fwd_args *args = (struct fwd_args*) data;
+    struct fwd_engine *engine = (struct fwd_engine*) data;
+    struct fwd_ctx *ctx;
+    struct io_uring_cqe *cqe;
+    unsigned head, seen;
+    int ret = 0, err;
 
-    union b_u16 sz;
-    int  ret = 0, rfd = 0, wfd = 1;
-    char exact = 0;
-    char *buf = 0;
+    fwd_pin(engine);
 
-    if (!(buf = malloc(args->read_sz))) {
-        ret = -ENOMEM;
+    if ((ret = fwd_engine_init(engine)) < 0) {
         goto end;
     }
-
-    io_uring_queue_init(QUEUE_DEPTH, &ring, 0);
-    if ((ret = io_uring_register_files(&ring, args->fds, 2)) < 0) {
+    if ((ret = prep_wake(engine)) < 0) {
         goto end;
     }
 
     while (working) {
-        if (args->read_hdr) {
-            exact = 1;
-            if ((ret = read_fd(&ring, rfd, buf, 2, exact)) < 0) {
-                goto end;
+        for (int i = 0; i < engine->len; ++i) {
+            ctx = &engine->ctxs[i];
+            if (!ctx->err && (ret = fwd_ctx_queue(ctx)) < 0) {
+                fwd_ctx_fail(ctx, ret);
             }
-            sz.b[0] = buf[0];
-            sz.b[1] = buf[1];
+        }
+
+        if (engine->mode == FWD_MODE_ADAPTIVE
+                && now_ns() < engine->poll_until) {
+            ret = io_uring_submit(&engine->ring);
         } else {
-            exact = 0;
-            sz.i = args->read_sz;
+            ret = io_uring_submit_and_wait(&engine->ring, 1);
         }
-        if ((ret = read_fd(&ring, rfd, buf, sz.i, exact)) < 0) {
+        if (ret < 0) {
+            if (ret == -EINTR) {
+                continue;
+            }
             goto end;
         }
 
-        sz.i = ret;
-
-        if (args->write_hdr) {
-            if ((ret = write_fd(&ring, wfd, sz.b, 2)) < 0) {
-                goto end;
+        seen = 0;
+        err = 0;
+        io_uring_for_each_cqe(&engine->ring, head, cqe) {
+            ++seen;
+            if (UDATA_SLOT(cqe->user_data) == ENGINE_SLOT) {
+                /* A shared sink was released, the next pass retries it */
+                if (!err) {
+                    err = prep_wake(engine);
+                }
+                continue;
+            }
+            if (UDATA_SLOT(cqe->user_data) >= engine->len) {
+                continue;
+            }
+            ctx = &engine->ctxs[UDATA_SLOT(cqe->user_data)];
+            if (ctx->err) {
+                fwd_ctx_reap(ctx, cqe);
+            } else if ((ret = handle_cqe(ctx, cqe)) < 0) {
+                fwd_ctx_fail(ctx, ret);
             }
         }
-        if ((ret = write_fd(&ring, wfd, buf, sz.i)) < 0) {
+        io_uring_cq_advance(&engine->ring, seen);
+        if ((ret = err) < 0) {
             goto end;
         }
+
+        /* Keep polling while traffic is flowing */
+        if (seen && engine->mode == FWD_MODE_ADAPTIVE) {
+            engine->poll_until = now_ns() + engine->busy_poll_ns;
+        }
     }
+    ret = 0;
 
 end:
-    io_uring_unregister_files(&ring);
-    free(args->fds);
-    free(args);
-    if (buf) free(buf);
+    fwd_engine_drain(engine);
+    fwd_engine_deinit(engine);
     return ret;
 }
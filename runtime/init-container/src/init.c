@@ -2,6 +2,8 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -11,12 +13,14 @@
 #include <stdnoreturn.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/reboot.h>
 #include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -46,6 +50,15 @@
 #define VPORT_CMD "/dev/vport0p1"
 #define VPORT_NET "/dev/vport0p2"
 #define VPORT_INET "/dev/vport0p3"
+/* Read ahead buffer of the command channel. */
+#define CMDS_RECV_BUF_SIZE (64 * 1024)
+/* How long to wait for a stalled host before powering off. */
+#define CMDS_DRAIN_TIMEOUT_MS 1000
+/* Bytes queued for the host above which reading of commands and pushing of
+ * stream output pause until the host catches up. */
+#define CMDS_QUEUE_MAX (1024 * 1024)
+/* Maximal number of body parts of a message sent to the host. */
+#define MSG_PARTS_MAX 5
 
 #define DEV_VPN "eth0"
 #define DEV_INET "eth1"
@@ -53,10 +66,24 @@
 #define MODE_RW_UGO (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
 #define OUTPUT_PATH_PREFIX "/var/tmp/guest_agent_private/fds"
 
+/* Output buffers start at a single page and grow up to their requested size,
+ * as long as all of them together fit in the budget. */
+#define OUTPUT_BUF_MIN_SIZE PAGE_SIZE
+#define OUTPUT_MEM_BUDGET (64 * 1024 * 1024)
+/* Output buffers idle for that long give their memory back. */
+#define OUTPUT_IDLE_SEC 30
+/* How often to look for the host while the command channel is hung up. */
+#define CMDS_RECONNECT_SEC 1
+
 #define NET_MEM_DEFAULT 1048576
 #define NET_MEM_MAX 2097152
 #define MTU_VPN 1220
 #define MTU_INET 65521
+#define FWD_THREADS_DEFAULT 1
+#define FWD_QUEUES_MAX 16
+// GSO super-frame with an Ethernet header and a `struct virtio_net_hdr`
+#define FWD_GSO_FRAME_MAX (65536 + 14 + 10)
+#define FWD_BUSY_POLL_US_DEFAULT 50
 
 
 struct new_process_args {
@@ -74,6 +101,8 @@ enum epoll_fd_type {
     EPOLL_FD_SIG,
     EPOLL_FD_OUT,
     EPOLL_FD_IN,
+    EPOLL_FD_IDLE,
+    EPOLL_FD_RECONNECT,
 };
 
 struct epoll_fd_desc {
@@ -87,24 +116,81 @@ extern char** environ;
 
 static int g_cmds_fd = -1;
 static int g_sig_fd = -1;
+static int g_idle_fd = -1;
+static int g_reconnect_fd = -1;
 static int g_epoll_fd = -1;
+/* Set once the main loop watches the command channel. */
+static struct epoll_fd_desc* g_cmds_epoll_desc = NULL;
+static uint32_t g_cmds_events = EPOLLIN;
+/* Set while the command channel is out of epoll, waiting for the host. */
+static bool g_cmds_detached = false;
+/* Responses to the items of the MSG_BATCH being handled. */
+static struct {
+    bool active;
+    msg_id_t msg_id;
+    uint64_t count;
+    char* buf;
+    size_t len;
+    size_t cap;
+} g_batch = { 0 };
+/* Bytes of streamed output the host accepts on the whole channel. */
+static uint64_t g_output_credit = OUTPUT_CHANNEL_CREDIT;
+/* Set when stream output waits for room in the queue to the host. */
+static bool g_output_held = false;
 static int g_vpn_fd = -1;
 static int g_vpn_tap_fd = -1;
 static int g_inet_fd = -1;
 static int g_inet_tap_fd = -1;
 
+static int g_fwd_queues = 1;
+
+// Forwarders of the interfaces, for MSG_NET_STATS
+struct fwd_desc {
+    int id;
+    uint16_t iface;
+    uint8_t dir;
+    uint8_t queue;
+    /* Additional queue of a multi-queue tap read by this forwarder, or -1. */
+    int tap_fd;
+};
+
+static struct fwd_desc g_fwd_descs[2 * (FWD_QUEUES_MAX + 1)];
+static size_t g_fwd_descs_len = 0;
+
+static_assert(NET_STATS_HIST_LEN == FWD_HIST_LEN, "Histogram sizes differ");
+
 static char g_lo_name[16];
 static char g_vpn_tap_name[16];
 static char g_inet_tap_name[16];
 
 static struct process_desc* g_entrypoint_desc = NULL;
 
+/* Memory currently held by all output buffers. */
+static size_t g_output_mem_used = 0;
+
+/* Closes the taps along with all their additional queues. */
+static void close_taps(void) {
+    for (size_t i = 0; i < g_fwd_descs_len; ++i) {
+        if (g_fwd_descs[i].tap_fd != -1) {
+            (void)close(g_fwd_descs[i].tap_fd);
+            g_fwd_descs[i].tap_fd = -1;
+        }
+    }
+    (void)close(g_inet_tap_fd);
+    (void)close(g_vpn_tap_fd);
+    g_inet_tap_fd = -1;
+    g_vpn_tap_fd = -1;
+}
+
 static noreturn void die(void) {
+    /* Give the host a chance to see the last responses. */
+    (void)send_queue_drain(g_cmds_fd, CMDS_DRAIN_TIMEOUT_MS);
     sync();
     (void)close(g_epoll_fd);
     (void)close(g_sig_fd);
     (void)close(g_inet_fd);
     (void)close(g_vpn_fd);
+    close_taps();
     (void)close(g_cmds_fd);
 
     while (1) {
@@ -122,6 +208,121 @@ static noreturn void die(void) {
     _x;                                                                 \
 })
 
+/* Same as CHECK() for the forward API, which returns negated error codes. */
+#define CHECK_FWD(x) ({                                                 \
+    int _x = (x);                                                       \
+    if (_x < 0) {                                                       \
+        fprintf(stderr, "Error at %s:%d: %s\n", __FILE__, __LINE__,     \
+                strerror(-_x));                                         \
+        die();                                                          \
+    }                                                                   \
+    _x;                                                                 \
+})
+
+static bool cmds_queue_full(void) {
+    return send_queue_pending(g_cmds_fd) >= CMDS_QUEUE_MAX;
+}
+
+/*
+ * Watches for EPOLLOUT on the command channel while anything is queued and
+ * stops reading commands while the queue is full.
+ */
+static void watch_cmds_out(void) {
+    size_t pending = send_queue_pending(g_cmds_fd);
+
+    if (!g_cmds_epoll_desc) {
+        /* No main loop to finish the job yet. */
+        if (pending) {
+            CHECK(send_queue_drain(g_cmds_fd, -1));
+        }
+        return;
+    }
+
+    uint32_t events = (cmds_queue_full() ? 0 : EPOLLIN)
+                    | (pending ? EPOLLOUT : 0);
+    if (events == g_cmds_events) {
+        return;
+    }
+    g_cmds_events = events;
+    if (g_cmds_detached) {
+        /* Applied once the host is back. */
+        return;
+    }
+
+    struct epoll_event event = {
+        .events = events,
+        .data.ptr = g_cmds_epoll_desc,
+    };
+    CHECK(epoll_ctl(g_epoll_fd, EPOLL_CTL_MOD, g_cmds_fd, &event));
+}
+
+/*
+ * Takes the command channel out of epoll while the host is not connected,
+ * since the hangup would be reported over and over. The reconnect timer puts
+ * it back.
+ */
+static void detach_cmds(void) {
+    struct itimerspec timeout = {
+        .it_value = { .tv_sec = CMDS_RECONNECT_SEC },
+    };
+
+    puts("Waiting for host connection ...");
+    CHECK(epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, g_cmds_fd, NULL));
+    CHECK(timerfd_settime(g_reconnect_fd, 0, &timeout, NULL));
+    g_cmds_detached = true;
+}
+
+static void batch_append(const void* data, size_t len) {
+    if (g_batch.cap - g_batch.len < len) {
+        size_t cap = g_batch.cap ? g_batch.cap : PAGE_SIZE;
+        while (cap - g_batch.len < len) {
+            cap *= 2;
+        }
+        char* buf = realloc(g_batch.buf, cap);
+        if (!buf) {
+            fprintf(stderr, "Batch response realloc failed: %m\n");
+            die();
+        }
+        g_batch.buf = buf;
+        g_batch.cap = cap;
+    }
+    memcpy(g_batch.buf + g_batch.len, data, len);
+    g_batch.len += len;
+}
+
+/* Queues a message with a body made of `parts` parts for the host. */
+static void send_message(msg_id_t msg_id, enum GUEST_MSG_TYPE type,
+                         const struct iovec* body, int parts) {
+    if (g_batch.active && msg_id == g_batch.msg_id) {
+        /* Response to a batch item, sent later as a part of RESP_BATCH. */
+        uint8_t item_type = type;
+        batch_append(&item_type, sizeof(item_type));
+        for (int i = 0; i < parts; ++i) {
+            batch_append(body[i].iov_base, body[i].iov_len);
+        }
+        ++g_batch.count;
+        return;
+    }
+
+    struct msg_hdr hdr = {
+        .msg_id = msg_id,
+        .type = type,
+    };
+    struct iovec iov[1 + MSG_PARTS_MAX] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+    };
+
+    assert(parts <= MSG_PARTS_MAX);
+    memcpy(iov + 1, body, parts * sizeof(*body));
+    if (msg_id) {
+        CHECK(send_iov(g_cmds_fd, iov, 1 + parts));
+    } else {
+        /* Notifications go behind the output that is already queued. */
+        CHECK(send_iov_bulk(g_cmds_fd, iov, 1 + parts));
+    }
+    watch_cmds_out();
+}
+
 static void load_module(const char* path) {
     int fd = CHECK(open(path, O_RDONLY | O_CLOEXEC));
     CHECK(syscall(SYS_finit_module, fd, "", 0));
@@ -154,6 +355,78 @@ int make_cloexec(int fd) {
 }
 */
 
+static bool is_pipe_redirect(enum REDIRECT_FD_TYPE type) {
+    return type == REDIRECT_FD_PIPE_BLOCKING
+        || type == REDIRECT_FD_PIPE_CYCLIC
+        || type == REDIRECT_FD_PIPE_STREAM;
+}
+
+/* Allocates the initial buffer of a pipe redirect. The first page is granted
+ * regardless of the budget, so that spawning never fails on it. */
+static int output_buffer_init(struct redir_fd_desc* redir, size_t max_size) {
+    size_t size = max_size < OUTPUT_BUF_MIN_SIZE ? max_size : OUTPUT_BUF_MIN_SIZE;
+
+    if (cyclic_buffer_init(&redir->buffer.cb, size) < 0) {
+        return -1;
+    }
+    redir->buffer.max_size = max_size;
+    g_output_mem_used += size;
+    return 0;
+}
+
+static void output_buffer_resize(struct redir_fd_desc* redir, size_t size) {
+    size_t old_size = redir->buffer.cb.size;
+
+    if (cyclic_buffer_resize(&redir->buffer.cb, size) < 0) {
+        if (redir->buffer.cb.size == old_size) {
+            /* Allocation failed, keep using the old buffer. */
+            return;
+        }
+        CHECK(-1);
+    }
+    g_output_mem_used = g_output_mem_used - old_size + size;
+}
+
+/* Grows the buffer of a pipe redirect, in pages, so that it can hold `wanted`
+ * bytes, up to its maximal size and as far as the budget allows. */
+static void output_buffer_grow(struct redir_fd_desc* redir, size_t wanted) {
+    size_t size = redir->buffer.cb.size;
+    size_t budget_left = g_output_mem_used < OUTPUT_MEM_BUDGET
+                       ? OUTPUT_MEM_BUDGET - g_output_mem_used
+                       : 0;
+    /* At least double, so that a burst needs only a few reallocations. */
+    size_t new_size = 2 * size;
+
+    if (new_size < wanted) {
+        new_size = (wanted + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    }
+    if (new_size > redir->buffer.max_size) {
+        new_size = redir->buffer.max_size;
+    }
+    if (new_size - size > budget_left) {
+        new_size = size + budget_left / PAGE_SIZE * PAGE_SIZE;
+    }
+    if (new_size > size) {
+        output_buffer_resize(redir, new_size);
+    }
+}
+
+/* Returns the memory of an idle buffer. A drained buffer shrinks back to its
+ * initial size, otherwise just the pages of its free part are released. */
+static void output_buffer_release(struct redir_fd_desc* redir) {
+    size_t size = redir->buffer.max_size < OUTPUT_BUF_MIN_SIZE
+                ? redir->buffer.max_size
+                : OUTPUT_BUF_MIN_SIZE;
+
+    if (redir->buffer.cb.size > size
+            && cyclic_buffer_data_size(&redir->buffer.cb) == 0) {
+        output_buffer_resize(redir, size);
+    }
+    if (cyclic_buffer_release_free(&redir->buffer.cb) < 0) {
+        fprintf(stderr, "Failed to release output buffer memory: %m\n");
+    }
+}
+
 static void cleanup_fd_desc(struct redir_fd_desc* fd_desc) {
     switch (fd_desc->type) {
         case REDIRECT_FD_FILE:
@@ -161,12 +434,16 @@ static void cleanup_fd_desc(struct redir_fd_desc* fd_desc) {
             break;
         case REDIRECT_FD_PIPE_BLOCKING:
         case REDIRECT_FD_PIPE_CYCLIC:
+        case REDIRECT_FD_PIPE_STREAM:
             if (fd_desc->buffer.fds[0] != -1) {
                 close(fd_desc->buffer.fds[0]);
             }
             if (fd_desc->buffer.fds[1] != -1) {
                 close(fd_desc->buffer.fds[1]);
             }
+            if (fd_desc->buffer.cb.buf != MAP_FAILED) {
+                g_output_mem_used -= fd_desc->buffer.cb.size;
+            }
             cyclic_buffer_deinit(&fd_desc->buffer.cb);
             break;
         default:
@@ -193,6 +470,7 @@ static bool redir_buffers_empty(struct redir_fd_desc *redirs, size_t len) {
                 break;
             case REDIRECT_FD_PIPE_BLOCKING:
             case REDIRECT_FD_PIPE_CYCLIC:
+            case REDIRECT_FD_PIPE_STREAM:
                 if (cyclic_buffer_data_size(&redirs[fd].buffer.cb) != 0) {
                     return false;
                 }
@@ -218,15 +496,13 @@ struct exit_reason {
 };
 
 static void send_process_died(uint64_t id, struct exit_reason reason) {
-    struct msg_hdr resp = {
-        .msg_id = 0,
-        .type = NOTIFY_PROCESS_DIED,
+    struct iovec body[] = {
+        { .iov_base = &id, .iov_len = sizeof(id) },
+        { .iov_base = &reason.status, .iov_len = sizeof(reason.status) },
+        { .iov_base = &reason.type, .iov_len = sizeof(reason.type) },
     };
 
-    CHECK(writen(g_cmds_fd, &resp, sizeof(resp)));
-    CHECK(writen(g_cmds_fd, &id, sizeof(id)));
-    CHECK(writen(g_cmds_fd, &reason.status, sizeof(reason.status)));
-    CHECK(writen(g_cmds_fd, &reason.type, sizeof(reason.type)));
+    send_message(0, NOTIFY_PROCESS_DIED, body, 3);
 }
 
 static struct exit_reason encode_status(int status, int type) {
@@ -311,6 +587,67 @@ static void block_signals(void) {
     CHECK(sigprocmask(SIG_BLOCK, &set, NULL));
 }
 
+static void setup_idle_timer(void) {
+    struct itimerspec period = {
+        .it_interval = { .tv_sec = OUTPUT_IDLE_SEC },
+        .it_value = { .tv_sec = OUTPUT_IDLE_SEC },
+    };
+
+    g_idle_fd = CHECK(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK));
+    CHECK(timerfd_settime(g_idle_fd, 0, &period, NULL));
+}
+
+static void release_idle_output(struct process_desc* proc_desc) {
+    for (size_t fd = 0; fd < 3; ++fd) {
+        struct redir_fd_desc* redir = &proc_desc->redirs[fd];
+        if (!is_pipe_redirect(redir->type)) {
+            continue;
+        }
+        if (!redir->buffer.active) {
+            output_buffer_release(redir);
+        }
+        redir->buffer.active = false;
+    }
+}
+
+static void handle_idle_timer(void) {
+    uint64_t expirations = 0;
+
+    if (read(g_idle_fd, &expirations, sizeof(expirations)) < 0) {
+        if (errno == EAGAIN) {
+            return;
+        }
+        fprintf(stderr, "Invalid timerfd read: %m\n");
+        die();
+    }
+    for_each_process(release_idle_output);
+}
+
+static void setup_reconnect_timer(void) {
+    g_reconnect_fd = CHECK(timerfd_create(CLOCK_MONOTONIC,
+                                          TFD_CLOEXEC | TFD_NONBLOCK));
+}
+
+/* Watches the command channel again, it is detached anew if still hung up. */
+static void handle_reconnect_timer(void) {
+    uint64_t expirations = 0;
+
+    if (read(g_reconnect_fd, &expirations, sizeof(expirations)) < 0) {
+        if (errno == EAGAIN) {
+            return;
+        }
+        fprintf(stderr, "Invalid timerfd read: %m\n");
+        die();
+    }
+
+    struct epoll_event event = {
+        .events = g_cmds_events,
+        .data.ptr = g_cmds_epoll_desc,
+    };
+    CHECK(epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, g_cmds_fd, &event));
+    g_cmds_detached = false;
+}
+
 static void setup_sigfd(void) {
     sigset_t set;
     CHECK(sigemptyset(&set));
@@ -401,6 +738,71 @@ int write_sys(char *path, size_t value) {
     return 0;
 }
 
+/* Looks up a `key=value` parameter on the kernel command line. Parameters with
+ * a dot in their name are not passed to init as environment variables. */
+static bool get_cmdline_param(const char *key, char *val, size_t val_sz) {
+    char buf[4096];
+    char *tok, *save = NULL;
+    size_t key_len = strlen(key);
+    size_t len;
+    FILE *f;
+
+    if ((f = fopen("/proc/cmdline", "r")) == 0) {
+        return false;
+    }
+    len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = '\0';
+
+    for (tok = strtok_r(buf, " \n", &save); tok;
+         tok = strtok_r(NULL, " \n", &save)) {
+        if (strncmp(tok, key, key_len) == 0 && tok[key_len] == '=') {
+            snprintf(val, val_sz, "%s", tok + key_len + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void add_fwd_desc(int id, uint16_t iface, uint8_t dir, uint8_t queue,
+                         int tap_fd) {
+    g_fwd_descs[g_fwd_descs_len++] = (struct fwd_desc){
+        .id = id,
+        .iface = iface,
+        .dir = dir,
+        .queue = queue,
+        .tap_fd = tap_fd,
+    };
+}
+
+// Forwards a tap to a port. Every additional queue of a multi-queue tap is
+// forwarded by the thread pinned to its own CPU and shares the rate limit of
+// the first one.
+static void forward_tap(uint16_t iface, char *tap_name, int tap_fd,
+                        int port_fd, int sz, int vnet_hdr, int tx_flags,
+                        int rx_flags) {
+    int id = CHECK_FWD(fwd_add(tap_fd, port_fd, sz, tx_flags));
+    add_fwd_desc(id, iface, NET_STATS_DIR_TX, 0, -1);
+    add_fwd_desc(CHECK_FWD(fwd_add(port_fd, tap_fd, sz, rx_flags)),
+                 iface, NET_STATS_DIR_RX, 0, -1);
+
+    if (g_fwd_queues < 2) {
+        return;
+    }
+    CHECK_FWD(fwd_set_cpu(id, 0));
+
+    for (int q = 1; q < g_fwd_queues; ++q) {
+        int fd = CHECK(net_create_tap(tap_name, vnet_hdr, 1));
+        int queue_id = fwd_add(fd, port_fd, sz, tx_flags);
+        if (queue_id < 0) {
+            (void)close(fd);
+        }
+        add_fwd_desc(CHECK_FWD(queue_id), iface, NET_STATS_DIR_TX, q, fd);
+        CHECK_FWD(fwd_set_cpu(queue_id, q));
+        CHECK_FWD(fwd_share_rate(queue_id, id));
+    }
+}
+
 static void setup_network(void) {
     char *hosts[][2] = {
         {"127.0.0.1",   "localhost"},
@@ -430,68 +832,140 @@ static void setup_network(void) {
     CHECK(write_sys("/proc/sys/net/core/wmem_default", NET_MEM_DEFAULT));
     CHECK(write_sys("/proc/sys/net/core/wmem_max", NET_MEM_MAX));
 
+    int tx_flags = FWD_WRITE_HDR;
+    int rx_flags = FWD_READ_HDR;
+    int vnet_hdr = 0;
+    char val[16];
+    if (get_cmdline_param("ya.fwd_splice", val, sizeof(val)) && atoi(val)) {
+        tx_flags |= FWD_SPLICE;
+    }
+    // Frames carry a virtio-net header and may be GSO super-frames,
+    // larger than the MTU and than a 16-bit length prefix allows
+    if (get_cmdline_param("ya.fwd_vnet_hdr", val, sizeof(val)) && atoi(val)) {
+        vnet_hdr = 1;
+        tx_flags |= FWD_LEN32;
+        rx_flags |= FWD_LEN32;
+    }
+    if (get_cmdline_param("ya.fwd_multi_queue", val, sizeof(val)) && atoi(val)) {
+        g_fwd_queues = sysconf(_SC_NPROCESSORS_ONLN);
+        if (g_fwd_queues > FWD_QUEUES_MAX) {
+            g_fwd_queues = FWD_QUEUES_MAX;
+        }
+        if (g_fwd_queues < 1) {
+            g_fwd_queues = 1;
+        }
+    }
+
     // FIXME: VPORT_NET and VPORT_INET are only present when supervised by a legacy ExeUnit
     if (access(VPORT_NET, F_OK) == 0) {
-        int vpn_sz = 4 * (MTU_VPN + 14);
+        int vpn_sz = vnet_hdr ? FWD_GSO_FRAME_MAX : 4 * (MTU_VPN + 14);
 
         g_vpn_fd = CHECK(open(VPORT_NET, O_RDWR | O_CLOEXEC));
-        g_vpn_tap_fd = CHECK(net_create_tap(g_vpn_tap_name));
+        g_vpn_tap_fd = CHECK(net_create_tap(g_vpn_tap_name, vnet_hdr,
+                                            g_fwd_queues > 1));
 
         CHECK(net_if_mtu(g_vpn_tap_name, MTU_VPN));
-        CHECK(fwd_start(g_vpn_tap_fd, g_vpn_fd, vpn_sz, false, true));
-        CHECK(fwd_start(g_vpn_fd, g_vpn_tap_fd, vpn_sz, true, false));
+        forward_tap(SUB_MSG_NET_IF_VPN, g_vpn_tap_name, g_vpn_tap_fd, g_vpn_fd, vpn_sz,
+                    vnet_hdr, tx_flags, rx_flags);
     } else {
         net_if_mtu(DEV_VPN, MTU_VPN);
     }
 
     if (access(VPORT_INET, F_OK) == 0) {
-        int inet_sz = MTU_INET + 14;
+        int inet_sz = vnet_hdr ? FWD_GSO_FRAME_MAX : MTU_INET + 14;
 
         g_inet_fd = CHECK(open(VPORT_INET, O_RDWR | O_CLOEXEC));
-        g_inet_tap_fd = CHECK(net_create_tap(g_inet_tap_name));
+        g_inet_tap_fd = CHECK(net_create_tap(g_inet_tap_name, vnet_hdr,
+                                             g_fwd_queues > 1));
 
         CHECK(net_if_mtu(g_inet_tap_name, MTU_INET));
-        CHECK(fwd_start(g_inet_tap_fd, g_inet_fd, inet_sz, false, true));
-        CHECK(fwd_start(g_inet_fd, g_inet_tap_fd, inet_sz, true, false));
+        forward_tap(SUB_MSG_NET_IF_INET, g_inet_tap_name, g_inet_tap_fd, g_inet_fd, inet_sz,
+                    vnet_hdr, tx_flags, rx_flags);
     } else {
         net_if_mtu(DEV_INET, MTU_INET);
     }
 }
 
-static void stop_network(void) {
-    fwd_stop();
+static void start_forwarding(void) {
+    // One thread per queue of multi-queue taps
+    int threads = g_fwd_queues > 1 ? g_fwd_queues : FWD_THREADS_DEFAULT;
+    enum fwd_mode mode = FWD_MODE_BLOCKING;
+    uint32_t busy_poll_us = FWD_BUSY_POLL_US_DEFAULT;
+    char val[16];
+
+    if (get_cmdline_param("ya.fwd_threads", val, sizeof(val))) {
+        char* end;
+        long n = strtol(val, &end, 10);
+        if (*end || n < 1 || n > INT_MAX) {
+            fprintf(stderr, "Invalid forwarder thread count: %s, using %d\n",
+                    val, FWD_THREADS_DEFAULT);
+            threads = FWD_THREADS_DEFAULT;
+        } else {
+            threads = n;
+        }
+    }
+    if (get_cmdline_param("ya.fwd_mode", val, sizeof(val))) {
+        if (strcmp(val, "sqpoll") == 0) {
+            mode = FWD_MODE_SQPOLL;
+        } else if (strcmp(val, "adaptive") == 0) {
+            mode = FWD_MODE_ADAPTIVE;
+        } else if (strcmp(val, "blocking") != 0) {
+            fprintf(stderr, "Invalid forwarder mode: %s, using blocking\n",
+                    val);
+        }
+    }
+    if (get_cmdline_param("ya.fwd_busy_poll_us", val, sizeof(val))) {
+        char* end;
+        long long n = strtoll(val, &end, 10);
+        if (end == val || *end || n < 0 || n > UINT32_MAX) {
+            fprintf(stderr, "Invalid forwarder busy poll time: %s, using %d\n",
+                    val, FWD_BUSY_POLL_US_DEFAULT);
+        } else {
+            busy_poll_us = n;
+        }
+    }
+
+    CHECK_FWD(fwd_run(threads, mode, busy_poll_us));
 }
 
-static void send_response_hdr(msg_id_t msg_id, enum GUEST_MSG_TYPE type) {
-    struct msg_hdr resp = {
-        .msg_id = msg_id,
-        .type = type,
-    };
-    CHECK(writen(g_cmds_fd, &resp, sizeof(resp)));
+static void stop_network(void) {
+    fwd_stop();
+    close_taps();
 }
 
 static void send_response_ok(msg_id_t msg_id) {
-    send_response_hdr(msg_id, RESP_OK);
+    send_message(msg_id, RESP_OK, NULL, 0);
 }
 
 static void send_response_err(msg_id_t msg_id, uint32_t ret_val) {
-    send_response_hdr(msg_id, RESP_ERR);
-    CHECK(writen(g_cmds_fd, &ret_val, sizeof(ret_val)));
+    struct iovec body = { .iov_base = &ret_val, .iov_len = sizeof(ret_val) };
+    send_message(msg_id, RESP_ERR, &body, 1);
 }
 
 static void send_response_u64(msg_id_t msg_id, uint64_t ret_val) {
-    send_response_hdr(msg_id, RESP_OK_U64);
-    CHECK(writen(g_cmds_fd, &ret_val, sizeof(ret_val)));
+    struct iovec body = { .iov_base = &ret_val, .iov_len = sizeof(ret_val) };
+    send_message(msg_id, RESP_OK_U64, &body, 1);
 }
 
 static void send_response_bytes(msg_id_t msg_id, const char* buf, size_t len) {
-    send_response_hdr(msg_id, RESP_OK_BYTES);
-    CHECK(send_bytes(g_cmds_fd, buf, len));
+    uint64_t size = len;
+    struct iovec body[] = {
+        { .iov_base = &size, .iov_len = sizeof(size) },
+        { .iov_base = (void*)buf, .iov_len = len },
+    };
+    send_message(msg_id, RESP_OK_BYTES, body, 2);
 }
 
 static void send_response_cyclic_buffer(msg_id_t msg_id, struct cyclic_buffer* cb, size_t len) {
-    send_response_hdr(msg_id, RESP_OK_BYTES);
-    CHECK(send_bytes_cyclic_buffer(g_cmds_fd, cb, len));
+    uint64_t size = 0;
+    struct iovec body[3] = {
+        { .iov_base = &size, .iov_len = sizeof(size) },
+    };
+
+    size = cyclic_buffer_peek(cb, len, body + 1);
+    send_message(msg_id, RESP_OK_BYTES, body, 3);
+    /* The data is in the queue now. */
+    cyclic_buffer_discard(cb, size);
 }
 
 static noreturn void handle_quit(msg_id_t msg_id) {
@@ -619,6 +1093,7 @@ static noreturn void child_wrapper(int parent_pipe[2],
                 break;
             case REDIRECT_FD_PIPE_BLOCKING:
             case REDIRECT_FD_PIPE_CYCLIC:
+            case REDIRECT_FD_PIPE_STREAM:
                 if (dup2(fd_descs[fd].buffer.fds[fd ? 1 : 0], fd) < 0) {
                     goto out;
                 }
@@ -744,13 +1219,15 @@ static uint32_t spawn_new_process(struct new_process_args* new_proc_args,
                 break;
             case REDIRECT_FD_PIPE_BLOCKING:
             case REDIRECT_FD_PIPE_CYCLIC:
+            case REDIRECT_FD_PIPE_STREAM:
                 proc_desc->redirs[fd].buffer.fds[0] = -1;
                 proc_desc->redirs[fd].buffer.fds[1] = -1;
 
-                if (cyclic_buffer_init(&proc_desc->redirs[fd].buffer.cb, fd_descs[fd].buffer.cb.size) < 0) {
+                if (output_buffer_init(&proc_desc->redirs[fd], fd_descs[fd].buffer.cb.size) < 0) {
                     ret = errno;
                     goto out_err;
                 }
+                proc_desc->redirs[fd].buffer.credit = fd_descs[fd].buffer.cb.size;
 
                 if (pipe2(proc_desc->redirs[fd].buffer.fds, O_CLOEXEC) < 0) {
                     ret = errno;
@@ -797,8 +1274,7 @@ static uint32_t spawn_new_process(struct new_process_args* new_proc_args,
 
 
     for (size_t fd = 0; fd < 3; ++fd) {
-        if (proc_desc->redirs[fd].type == REDIRECT_FD_PIPE_BLOCKING
-                || proc_desc->redirs[fd].type == REDIRECT_FD_PIPE_CYCLIC) {
+        if (is_pipe_redirect(proc_desc->redirs[fd].type)) {
             CHECK(close(proc_desc->redirs[fd].buffer.fds[fd ? 1 : 0]));
             proc_desc->redirs[fd].buffer.fds[fd ? 1 : 0] = -1;
 
@@ -873,6 +1349,7 @@ static uint32_t parse_fd_redir(struct redir_fd_desc fd_descs[3]) {
             break;
         case REDIRECT_FD_PIPE_BLOCKING:
         case REDIRECT_FD_PIPE_CYCLIC:
+        case REDIRECT_FD_PIPE_STREAM:
             CHECK(recv_u64(g_cmds_fd, &fd_desc.buffer.cb.size));
             fd_desc.buffer.cb.buf = MAP_FAILED;
             fd_desc.buffer.fds[0] = -1;
@@ -889,8 +1366,7 @@ static uint32_t parse_fd_redir(struct redir_fd_desc fd_descs[3]) {
         return EINVAL;
     }
 
-    if (fd_desc.type == REDIRECT_FD_PIPE_BLOCKING
-            || fd_desc.type == REDIRECT_FD_PIPE_CYCLIC) {
+    if (is_pipe_redirect(fd_desc.type)) {
         if (!is_fd_buf_size_valid(fd_desc.buffer.cb.size)) {
             return EINVAL;
         }
@@ -1230,13 +1706,17 @@ static void handle_query_output(msg_id_t msg_id) {
             break;
         case REDIRECT_FD_PIPE_BLOCKING:
         case REDIRECT_FD_PIPE_CYCLIC:
+        case REDIRECT_FD_PIPE_STREAM:
             if (off) {
                 ret = EINVAL;
                 goto out_err;
             }
             bool was_full = cyclic_buffer_free_size(&proc_desc->redirs[fd].buffer.cb) == 0;
             send_response_cyclic_buffer(msg_id, &proc_desc->redirs[fd].buffer.cb, len);
-            if (was_full) {
+            proc_desc->redirs[fd].buffer.drop_notified = false;
+            proc_desc->redirs[fd].buffer.active = true;
+            /* Cyclic pipes are never deregistered, they overwrite instead. */
+            if (was_full && proc_desc->redirs[fd].type != REDIRECT_FD_PIPE_CYCLIC) {
                 if (add_epoll_fd_desc(&proc_desc->redirs[fd],
                                       proc_desc->redirs[fd].buffer.fds[0],
                                       fd,
@@ -1262,30 +1742,139 @@ out_err:
 }
 
 static void send_output_available_notification(uint64_t id, uint32_t fd) {
-    struct msg_hdr resp = {
-        .msg_id = 0,
-        .type = NOTIFY_OUTPUT_AVAILABLE,
+    struct iovec body[] = {
+        { .iov_base = &id, .iov_len = sizeof(id) },
+        { .iov_base = &fd, .iov_len = sizeof(fd) },
+    };
+
+    send_message(0, NOTIFY_OUTPUT_AVAILABLE, body, 2);
+}
+
+static void send_output_dropped_notification(uint64_t id, uint32_t fd,
+                                             uint64_t dropped) {
+    struct iovec body[] = {
+        { .iov_base = &id, .iov_len = sizeof(id) },
+        { .iov_base = &fd, .iov_len = sizeof(fd) },
+        { .iov_base = &dropped, .iov_len = sizeof(dropped) },
+    };
+
+    send_message(0, NOTIFY_OUTPUT_DROPPED, body, 3);
+}
+
+static uint64_t credit_add(uint64_t credit, uint64_t bytes) {
+    return bytes > UINT64_MAX - credit ? UINT64_MAX : credit + bytes;
+}
+
+/*
+ * Pushes as much of the buffered output of a REDIRECT_FD_PIPE_STREAM redirect
+ * to the host as its credit, the channel credit and the room left in the
+ * queue to the host allow.
+ */
+static void push_output(struct process_desc* proc_desc, uint32_t fd) {
+    struct redir_fd_desc* redir = &proc_desc->redirs[fd];
+    uint64_t credit = redir->buffer.credit < g_output_credit
+                    ? redir->buffer.credit
+                    : g_output_credit;
+    size_t pending = send_queue_pending(g_cmds_fd);
+    uint64_t room = pending < CMDS_QUEUE_MAX ? CMDS_QUEUE_MAX - pending : 0;
+    uint64_t len = 0;
+    struct iovec body[5] = {
+        { .iov_base = &proc_desc->id, .iov_len = sizeof(proc_desc->id) },
+        { .iov_base = &fd, .iov_len = sizeof(fd) },
+        { .iov_base = &len, .iov_len = sizeof(len) },
     };
 
-    CHECK(writen(g_cmds_fd, &resp, sizeof(resp)));
-    CHECK(writen(g_cmds_fd, &id, sizeof(id)));
-    CHECK(writen(g_cmds_fd, &fd, sizeof(fd)));
+    bool limited = room < credit;
+
+    len = cyclic_buffer_peek(&redir->buffer.cb, limited ? room : credit,
+                             body + 3);
+    if (limited && cyclic_buffer_data_size(&redir->buffer.cb) > len) {
+        /* Output left behind for lack of room waits for the queue to drain. */
+        g_output_held = true;
+    }
+    if (!len) {
+        return;
+    }
+    send_message(0, NOTIFY_OUTPUT_DATA, body, body[4].iov_len ? 5 : 4);
+    cyclic_buffer_discard(&redir->buffer.cb, len);
+    redir->buffer.credit -= len;
+    g_output_credit -= len;
+}
+
+/* Pushes the output held back by missing credit or a full queue to the host of
+ * all streams of a process, letting the writers go on. */
+static void resume_output(struct process_desc* proc_desc) {
+    for (uint32_t fd = 1; fd < 3; ++fd) {
+        struct redir_fd_desc* redir = &proc_desc->redirs[fd];
+        if (redir->type != REDIRECT_FD_PIPE_STREAM) {
+            continue;
+        }
+
+        bool was_full = cyclic_buffer_free_size(&redir->buffer.cb) == 0;
+        push_output(proc_desc, fd);
+        if (was_full && cyclic_buffer_free_size(&redir->buffer.cb) != 0) {
+            if (add_epoll_fd_desc(redir, redir->buffer.fds[0], fd, NULL) < 0) {
+                if (errno != EEXIST) {
+                    CHECK(-1);
+                }
+            }
+        }
+    }
+
+    if (!proc_desc->is_alive && redir_buffers_empty(proc_desc->redirs, 3)) {
+        delete_proc(proc_desc);
+    }
+}
+
+/*
+ * Makes room for the output pending on a pipe redirect, growing its buffer if
+ * possible. A REDIRECT_FD_PIPE_CYCLIC buffer that cannot grow any further
+ * drops the oldest bytes instead. Returns the number of bytes to read.
+ */
+static size_t make_room_for_output(struct epoll_fd_desc* epoll_fd_desc) {
+    struct redir_fd_desc* redir = epoll_fd_desc->data;
+    struct cyclic_buffer* cb = &redir->buffer.cb;
+    size_t free_space = cyclic_buffer_free_size(cb);
+    int pending = 0;
+
+    CHECK(ioctl(epoll_fd_desc->fd, FIONREAD, &pending));
+    if ((size_t)pending > free_space) {
+        output_buffer_grow(redir, cyclic_buffer_data_size(cb) + pending);
+        free_space = cyclic_buffer_free_size(cb);
+    }
+    if ((size_t)pending <= free_space || redir->type != REDIRECT_FD_PIPE_CYCLIC) {
+        return free_space;
+    }
+
+    size_t to_read = (size_t)pending < cb->size ? (size_t)pending : cb->size;
+    redir->buffer.dropped += cyclic_buffer_discard(cb, to_read - free_space);
+    return to_read;
 }
 
 static void handle_output_available(struct epoll_fd_desc** epoll_fd_desc_ptr) {
     struct epoll_fd_desc* epoll_fd_desc = *epoll_fd_desc_ptr;
-    struct cyclic_buffer* cb = &epoll_fd_desc->data->buffer.cb;
-    size_t to_read = cyclic_buffer_free_size(cb);
+    struct redir_fd_desc* redir = epoll_fd_desc->data;
+    struct cyclic_buffer* cb = &redir->buffer.cb;
+    uint64_t dropped = redir->buffer.dropped;
     bool needs_notification = cyclic_buffer_data_size(cb) == 0;
+    /* XXX: this is ugly, but for now there is no other way of obtaining process id here. */
+    int fd = epoll_fd_desc->src_fd;
+    struct process_desc* process_desc = CONTAINER_OF(redir, struct process_desc, redirs[fd]);
+    size_t to_read = make_room_for_output(epoll_fd_desc);
 
+    redir->buffer.active = true;
     if (to_read == 0) {
+        if (redir->type == REDIRECT_FD_PIPE_CYCLIC) {
+            /* Cyclic buffers never stall the writer, nothing is pending. */
+            return;
+        }
         /* Buffer is full, deregister `epoll_fd_desc` untill it get's emptied. */
         CHECK(del_epoll_fd_desc(epoll_fd_desc));
         *epoll_fd_desc_ptr = NULL;
         return;
     }
 
-    ssize_t ret = cyclic_buffer_read(epoll_fd_desc->fd, cb, to_read);
+    ssize_t ret = cyclic_buffer_readv(epoll_fd_desc->fd, cb, to_read);
     if (ret < 0) {
         if (errno == EAGAIN) {
             /* This was a spurious wakeup. */
@@ -1302,12 +1891,112 @@ static void handle_output_available(struct epoll_fd_desc** epoll_fd_desc_ptr) {
         *epoll_fd_desc_ptr = NULL;
     }
 
-    if (needs_notification) {
-        /* XXX: this is ugly, but for now there is no other way of obtaining process id here. */
-        int fd = epoll_fd_desc->src_fd;
-        struct process_desc* process_desc = CONTAINER_OF(epoll_fd_desc->data, struct process_desc, redirs[fd]);
+    if (redir->type == REDIRECT_FD_PIPE_STREAM) {
+        push_output(process_desc, fd);
+    } else if (needs_notification) {
         send_output_available_notification(process_desc->id, fd);
     }
+    if (redir->buffer.dropped != dropped && !redir->buffer.drop_notified) {
+        /* Report once until the host queries the output again. */
+        send_output_dropped_notification(process_desc->id, fd,
+                                         redir->buffer.dropped);
+        redir->buffer.drop_notified = true;
+    }
+}
+
+static void handle_output_credit(msg_id_t msg_id) {
+    bool done = false;
+    uint32_t ret = 0;
+    uint64_t id = 0;
+    uint8_t fd = 1;
+    uint64_t bytes = 0;
+    uint64_t channel = 0;
+    struct process_desc* proc_desc = NULL;
+
+    while (!done) {
+        uint8_t subtype = 0;
+        CHECK(recv_u8(g_cmds_fd, &subtype));
+
+        switch (subtype) {
+            case SUB_MSG_OUTPUT_CREDIT_END:
+                done = true;
+                break;
+            case SUB_MSG_OUTPUT_CREDIT_ID:
+                CHECK(recv_u64(g_cmds_fd, &id));
+                break;
+            case SUB_MSG_OUTPUT_CREDIT_FD:
+                CHECK(recv_u8(g_cmds_fd, &fd));
+                break;
+            case SUB_MSG_OUTPUT_CREDIT_BYTES:
+                CHECK(recv_u64(g_cmds_fd, &bytes));
+                break;
+            case SUB_MSG_OUTPUT_CREDIT_CHANNEL:
+                CHECK(recv_u64(g_cmds_fd, &channel));
+                break;
+            default:
+                fprintf(stderr, "Unknown MSG_OUTPUT_CREDIT subtype: %hhu\n",
+                        subtype);
+                die();
+        }
+    }
+
+    if ((!id && !channel) || !fd || fd > 2) {
+        ret = EINVAL;
+        goto out_err;
+    }
+
+    /* The channel credit returns output the host has consumed, so it counts
+     * even if the stream is gone by now. */
+    g_output_credit = credit_add(g_output_credit, channel);
+
+    if (id) {
+        proc_desc = find_process_by_id(id);
+        if (!proc_desc) {
+            ret = ESRCH;
+        } else if (proc_desc->redirs[fd].type != REDIRECT_FD_PIPE_STREAM) {
+            ret = EINVAL;
+        } else {
+            struct redir_fd_desc* redir = &proc_desc->redirs[fd];
+            redir->buffer.credit = credit_add(redir->buffer.credit, bytes);
+            redir->buffer.active = true;
+        }
+    }
+    if (ret == ESRCH && channel) {
+        /* A stream that ended needs no more credit. */
+        ret = 0;
+    }
+    if (ret) {
+        goto out_err;
+    }
+
+    send_response_ok(msg_id);
+
+    if (channel) {
+        /* Any stream might have been waiting for the channel. */
+        for_each_process(resume_output);
+    } else {
+        resume_output(proc_desc);
+    }
+    return;
+
+out_err:
+    send_response_err(msg_id, ret);
+}
+
+// Rate limits both directions of an interface. Returns an errno value.
+static int set_fwd_rate(uint16_t iface, const struct fwd_rate* rate) {
+    int ret = ENODEV;
+
+    for (size_t i = 0; i < g_fwd_descs_len; ++i) {
+        struct fwd_desc* desc = &g_fwd_descs[i];
+        if (desc->iface != iface || desc->queue != 0) {
+            continue;
+        }
+        if ((ret = -fwd_set_rate(desc->id, rate)) != 0) {
+            break;
+        }
+    }
+    return ret;
 }
 
 static void handle_net_ctl(msg_id_t msg_id) {
@@ -1318,6 +2007,8 @@ static void handle_net_ctl(msg_id_t msg_id) {
     char* gateway = NULL;
     char* if_addr = NULL;
     uint16_t if_kind = 0;
+    struct fwd_rate rate = { 0 };
+    bool set_rate = false;
 
     char* if_name = NULL;
     int ret = 0;
@@ -1348,6 +2039,18 @@ static void handle_net_ctl(msg_id_t msg_id) {
             case SUB_MSG_NET_CTL_IF:
                 CHECK(recv_u16(g_cmds_fd, &if_kind));
                 break;
+            case SUB_MSG_NET_CTL_RATE_BPS:
+                CHECK(recv_u64(g_cmds_fd, &rate.bytes_per_sec));
+                set_rate = true;
+                break;
+            case SUB_MSG_NET_CTL_RATE_PPS:
+                CHECK(recv_u64(g_cmds_fd, &rate.frames_per_sec));
+                set_rate = true;
+                break;
+            case SUB_MSG_NET_CTL_RATE_BURST:
+                CHECK(recv_u32(g_cmds_fd, &rate.burst_us));
+                set_rate = true;
+                break;
             default:
                 fprintf(stderr, "Unknown MSG_NET_CTL subtype: %hhu\n",
                         subtype);
@@ -1416,6 +2119,17 @@ static void handle_net_ctl(msg_id_t msg_id) {
         }
     }
 
+    if (set_rate) {
+        fprintf(stderr, "Limiting '%s' to %" PRIu64 " B/s, %" PRIu64
+                " frames/s, %" PRIu32 " us burst\n",
+                if_name, rate.bytes_per_sec, rate.frames_per_sec,
+                rate.burst_us);
+
+        if ((ret = set_fwd_rate(if_kind, &rate)) != 0) {
+            goto out_err;
+        }
+    }
+
     if (gateway) {
         fprintf(stderr, "Configuring '%s' with gateway: %s\n", if_name, gateway);
 
@@ -1498,6 +2212,139 @@ out_err:
         : send_response_err(msg_id, ret);
 }
 
+static void handle_net_stats(msg_id_t msg_id) {
+    bool done = false;
+
+    while (!done) {
+        uint8_t subtype = 0;
+        CHECK(recv_u8(g_cmds_fd, &subtype));
+
+        switch (subtype) {
+            case SUB_MSG_NET_STATS_END:
+                done = true;
+                break;
+            default:
+                fprintf(stderr, "Unknown MSG_NET_STATS subtype: %hhu\n",
+                        subtype);
+                die();
+        }
+    }
+
+    struct net_stats records[sizeof(g_fwd_descs) / sizeof(*g_fwd_descs)];
+
+    for (size_t i = 0; i < g_fwd_descs_len; ++i) {
+        struct fwd_desc* desc = &g_fwd_descs[i];
+        struct fwd_stats stats;
+        int ret = fwd_get_stats(desc->id, &stats);
+
+        if (ret < 0) {
+            send_response_err(msg_id, -ret);
+            return;
+        }
+
+        records[i] = (struct net_stats){
+            .iface = desc->iface,
+            .dir = desc->dir,
+            .queue = desc->queue,
+            .frames = stats.frames,
+            .bytes = stats.bytes,
+            .short_reads = stats.short_reads,
+            .write_retries = stats.write_retries,
+            .stall_ns = stats.stall_ns,
+            .batches = stats.batches,
+            .batch_frames = stats.batch_frames,
+            .wakeups = stats.wakeups,
+            .wake_ns_total = stats.wake_ns_total,
+            .wake_ns_max = stats.wake_ns_max,
+        };
+        memcpy(records[i].hist, stats.hist, sizeof(records[i].hist));
+        records[i].proto_errors = stats.proto_errors;
+    }
+
+    send_response_bytes(msg_id, (const char*)records,
+                        g_fwd_descs_len * sizeof(*records));
+}
+
+static void handle_batch_item(msg_id_t msg_id, uint8_t type) {
+    switch (type) {
+        case MSG_RUN_PROCESS:
+            handle_run_process(msg_id);
+            break;
+        case MSG_KILL_PROCESS:
+            handle_kill_process(msg_id);
+            break;
+        case MSG_MOUNT_VOLUME:
+            handle_mount(msg_id);
+            break;
+        case MSG_QUERY_OUTPUT:
+            handle_query_output(msg_id);
+            break;
+        case MSG_NET_CTL:
+            handle_net_ctl(msg_id);
+            break;
+        case MSG_NET_HOST:
+            handle_net_host(msg_id);
+            break;
+        case MSG_NET_STATS:
+            handle_net_stats(msg_id);
+            break;
+        case MSG_OUTPUT_CREDIT:
+            handle_output_credit(msg_id);
+            break;
+        default:
+            /* The rest of the batch cannot be parsed. */
+            fprintf(stderr, "Message type not allowed in a batch: %hhu\n",
+                    type);
+            g_batch.active = false;
+            send_response_err(msg_id, ENOPROTOOPT);
+            die();
+    }
+}
+
+static void handle_batch(msg_id_t msg_id) {
+    bool done = false;
+
+    g_batch.active = true;
+    g_batch.msg_id = msg_id;
+    g_batch.count = 0;
+    g_batch.len = 0;
+
+    while (!done) {
+        uint8_t subtype = 0;
+        uint8_t type = 0;
+
+        CHECK(recv_u8(g_cmds_fd, &subtype));
+
+        switch (subtype) {
+            case SUB_MSG_BATCH_END:
+                done = true;
+                break;
+            case SUB_MSG_BATCH_ITEM:
+                CHECK(recv_u8(g_cmds_fd, &type));
+                handle_batch_item(msg_id, type);
+                break;
+            default:
+                fprintf(stderr, "Unknown MSG_BATCH subtype: %hhu\n", subtype);
+                die();
+        }
+    }
+
+    g_batch.active = false;
+
+    uint64_t count = g_batch.count;
+    struct iovec body[] = {
+        { .iov_base = &count, .iov_len = sizeof(count) },
+        { .iov_base = g_batch.buf, .iov_len = g_batch.len },
+    };
+    send_message(msg_id, RESP_BATCH, body, g_batch.len ? 2 : 1);
+
+    /* Queries might have made it big, do not keep it around. */
+    free(g_batch.buf);
+    g_batch.buf = NULL;
+    g_batch.cap = 0;
+    g_batch.len = 0;
+}
+
 static void handle_message(void) {
     struct msg_hdr msg_hdr;
 
@@ -1531,6 +2378,18 @@ static void handle_message(void) {
             fprintf(stderr, "MSG_NET_HOST\n");
             handle_net_host(msg_hdr.msg_id);
             break;
+        case MSG_NET_STATS:
+            fprintf(stderr, "MSG_NET_STATS\n");
+            handle_net_stats(msg_hdr.msg_id);
+            break;
+        case MSG_BATCH:
+            fprintf(stderr, "MSG_BATCH\n");
+            handle_batch(msg_hdr.msg_id);
+            break;
+        case MSG_OUTPUT_CREDIT:
+            /* Sent for every chunk of streamed output, not logged. */
+            handle_output_credit(msg_hdr.msg_id);
+            break;
         case MSG_UPLOAD_FILE:
         case MSG_PUT_INPUT:
         case MSG_SYNC_FS:
@@ -1560,6 +2419,8 @@ static noreturn void main_loop(void) {
     event.events = EPOLLIN;
     event.data.ptr = epoll_fd_desc;
     CHECK(epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, g_cmds_fd, &event));
+    g_cmds_epoll_desc = epoll_fd_desc;
+    watch_cmds_out();
 
     epoll_fd_desc = malloc(sizeof(*epoll_fd_desc));
     if (!epoll_fd_desc) {
@@ -1574,7 +2435,38 @@ static noreturn void main_loop(void) {
     event.data.ptr = epoll_fd_desc;
     CHECK(epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, g_sig_fd, &event));
 
+    epoll_fd_desc = malloc(sizeof(*epoll_fd_desc));
+    if (!epoll_fd_desc) {
+        fprintf(stderr, "epoll_fd_desc malloc failed: %m\n");
+        die();
+    }
+
+    epoll_fd_desc->type = EPOLL_FD_IDLE;
+    epoll_fd_desc->fd = g_idle_fd;
+    epoll_fd_desc->data = NULL;
+    event.events = EPOLLIN;
+    event.data.ptr = epoll_fd_desc;
+    CHECK(epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, g_idle_fd, &event));
+
+    epoll_fd_desc = malloc(sizeof(*epoll_fd_desc));
+    if (!epoll_fd_desc) {
+        fprintf(stderr, "epoll_fd_desc malloc failed: %m\n");
+        die();
+    }
+
+    epoll_fd_desc->type = EPOLL_FD_RECONNECT;
+    epoll_fd_desc->fd = g_reconnect_fd;
+    epoll_fd_desc->data = NULL;
+    event.events = EPOLLIN;
+    event.data.ptr = epoll_fd_desc;
+    CHECK(epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, g_reconnect_fd, &event));
+
     while (1) {
+        if (g_output_held && !cmds_queue_full()) {
+            g_output_held = false;
+            for_each_process(resume_output);
+        }
+
         if (epoll_wait(g_epoll_fd, &event, 1, -1) < 0) {
             if (errno == EINTR || errno == EAGAIN) {
                 continue;
@@ -1597,15 +2489,37 @@ static noreturn void main_loop(void) {
         epoll_fd_desc = event.data.ptr;
         switch (epoll_fd_desc->type) {
             case EPOLL_FD_CMDS:
-                if (event.events & EPOLLIN) {
+                if (event.events & EPOLLOUT) {
+                    CHECK(send_queue_flush(g_cmds_fd));
+                }
+                if ((event.events & EPOLLIN) && !cmds_queue_full()) {
                     handle_message();
+                } else if ((event.events & EPOLLHUP)
+                        && !(event.events & EPOLLOUT)) {
+                    /* No host to take the full queue. */
+                    detach_cmds();
                 }
+                /* Messages already read ahead do not wake epoll up. */
+                while (recv_buffer_pending(g_cmds_fd) && !cmds_queue_full()) {
+                    handle_message();
+                }
+                watch_cmds_out();
                 break;
             case EPOLL_FD_SIG:
                 if (event.events & EPOLLIN) {
                     handle_sigchld();
                 }
                 break;
+            case EPOLL_FD_IDLE:
+                if (event.events & EPOLLIN) {
+                    handle_idle_timer();
+                }
+                break;
+            case EPOLL_FD_RECONNECT:
+                if (event.events & EPOLLIN) {
+                    handle_reconnect_timer();
+                }
+                break;
             case EPOLL_FD_OUT:
                 /* Need to handle EPOLLOUT and EPOLLERR here. */
                 fprintf(stderr, "EPOLL_FD_OUT is not implemented yet\n");
@@ -1663,6 +2577,10 @@ int main(void) {
     load_module("/9p.ko");
 
     g_cmds_fd = CHECK(open(VPORT_CMD, O_RDWR | O_CLOEXEC));
+    CHECK(recv_buffer_attach(g_cmds_fd, CMDS_RECV_BUF_SIZE));
+    /* Responses are queued, so that a stalled host does not block us. */
+    CHECK(make_nonblocking(g_cmds_fd));
+    send_queue_attach(g_cmds_fd);
 
     CHECK(mkdir("/mnt", S_IRWXU));
     CHECK(mkdir("/mnt/image", S_IRWXU));
@@ -1726,10 +2644,13 @@ int main(void) {
     }
 
     setup_network();
+    start_forwarding();
     setup_agent_directories();
 
     block_signals();
     setup_sigfd();
+    setup_idle_timer();
+    setup_reconnect_timer();
 
     main_loop();
     stop_network();
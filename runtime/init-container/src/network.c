@@ -8,6 +8,7 @@
 #include <linux/route.h>
 #include <linux/socket.h>
 #include <linux/string.h>
+#include <linux/virtio_net.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -63,9 +64,10 @@ end:
     return ret;
 }
 
-int net_create_tap(char *name) {
+int net_create_tap(char *name, int vnet_hdr, int multi_queue) {
     struct ifreq ifr;
     int fd, ret;
+    int hdr_sz = sizeof(struct virtio_net_hdr);
 
     if ((fd = open("/dev/net/tun", O_RDWR)) < 0) {
         return fd;
@@ -73,6 +75,12 @@ int net_create_tap(char *name) {
 
     memset(&ifr, 0, sizeof(ifr));
     ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    if (vnet_hdr) {
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    }
+    if (multi_queue) {
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    }
 
     if (*name) {
         strncpy(ifr.ifr_name, name, sizeof(ifr.ifr_name) - 1);
@@ -82,6 +90,17 @@ int net_create_tap(char *name) {
         goto err;
     }
 
+    if (vnet_hdr) {
+        if ((ret = ioctl(fd, TUNSETVNETHDRSZ, &hdr_sz)) < 0) {
+            goto err;
+        }
+        /* Checksum offload and TSO super-frames are passed through as-is */
+        if ((ret = ioctl(fd, TUNSETOFFLOAD,
+                         TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN)) < 0) {
+            goto err;
+        }
+    }
+
     strcpy(name, ifr.ifr_name);
     return fd;
 err:
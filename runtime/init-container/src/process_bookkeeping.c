@@ -50,3 +50,13 @@ struct process_desc* find_process_by_pid(pid_t pid) {
     }
     return NULL;
 }
+
+void for_each_process(void (*fn)(struct process_desc*)) {
+    struct process_desc* proc_desc = g_all_processes;
+    while (proc_desc) {
+        /* `fn` might remove the process. */
+        struct process_desc* next = proc_desc->next;
+        fn(proc_desc);
+        proc_desc = next;
+    }
+}
@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "spsc_ring.h"
+
+static size_t min(size_t a, size_t b) {
+    return a < b ? a : b;
+}
+
+int spsc_ring_init(struct spsc_ring* ring, size_t size) {
+    if (!size || (size & (size - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ring->buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring->buf == MAP_FAILED) {
+        return -1;
+    }
+
+    ring->size = size;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->tail_cache = 0;
+    ring->head_cache = 0;
+    return 0;
+}
+
+int spsc_ring_deinit(struct spsc_ring* ring) {
+    if (ring->buf == MAP_FAILED || !ring->size) {
+        return 0;
+    }
+    int ret = munmap(ring->buf, ring->size);
+    ring->buf = MAP_FAILED;
+    return ret;
+}
+
+size_t spsc_ring_data_size(struct spsc_ring* ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    return head - tail;
+}
+
+size_t spsc_ring_free_size(struct spsc_ring* ring) {
+    return ring->size - spsc_ring_data_size(ring);
+}
+
+/* Producer side: free space, looking at the consumer only if needed. */
+static size_t producer_space(struct spsc_ring* ring, size_t head, size_t wanted) {
+    size_t space = ring->size - (head - ring->tail_cache);
+    if (space < wanted) {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        space = ring->size - (head - ring->tail_cache);
+    }
+    return space;
+}
+
+/* Consumer side: available data, looking at the producer only if needed. */
+static size_t consumer_data(struct spsc_ring* ring, size_t tail, size_t wanted) {
+    size_t data = ring->head_cache - tail;
+    if (data < wanted) {
+        ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+        data = ring->head_cache - tail;
+    }
+    return data;
+}
+
+/* Describes `len` bytes starting at position `pos` of the ring. */
+static int ring_iov(struct spsc_ring* ring, size_t pos, size_t len,
+                    struct iovec iov[2]) {
+    size_t off = pos & (ring->size - 1);
+    size_t first = min(len, ring->size - off);
+
+    iov[0].iov_base = ring->buf + off;
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring->buf;
+    iov[1].iov_len = len - first;
+    return iov[1].iov_len ? 2 : 1;
+}
+
+size_t spsc_ring_push(struct spsc_ring* ring, const void* data, size_t len) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct iovec iov[2];
+
+    len = min(len, producer_space(ring, head, len));
+    if (!len) {
+        return 0;
+    }
+
+    ring_iov(ring, head, len, iov);
+    memcpy(iov[0].iov_base, data, iov[0].iov_len);
+    memcpy(iov[1].iov_base, (const char*)data + iov[0].iov_len, iov[1].iov_len);
+    atomic_store_explicit(&ring->head, head + len, memory_order_release);
+    return len;
+}
+
+size_t spsc_ring_pop(struct spsc_ring* ring, void* data, size_t len) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    struct iovec iov[2];
+
+    len = min(len, consumer_data(ring, tail, len));
+    if (!len) {
+        return 0;
+    }
+
+    ring_iov(ring, tail, len, iov);
+    memcpy(data, iov[0].iov_base, iov[0].iov_len);
+    memcpy((char*)data + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+    atomic_store_explicit(&ring->tail, tail + len, memory_order_release);
+    return len;
+}
+
+ssize_t spsc_ring_read(int fd, struct spsc_ring* ring, size_t count) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t len = min(count, producer_space(ring, head, count));
+    struct iovec iov[2];
+    ssize_t ret;
+
+    if (!len) {
+        return 0;
+    }
+
+    int iovcnt = ring_iov(ring, head, len, iov);
+    do {
+        ret = readv(fd, iov, iovcnt);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    atomic_store_explicit(&ring->head, head + ret, memory_order_release);
+    return ret;
+}
+
+ssize_t spsc_ring_write(int fd, struct spsc_ring* ring, size_t count) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t len = min(count, consumer_data(ring, tail, count));
+    struct iovec iov[2];
+    ssize_t ret;
+
+    if (!len) {
+        return 0;
+    }
+
+    int iovcnt = ring_iov(ring, tail, len, iov);
+    do {
+        ret = writev(fd, iov, iovcnt);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    atomic_store_explicit(&ring->tail, tail + ret, memory_order_release);
+    return ret;
+}
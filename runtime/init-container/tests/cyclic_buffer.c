@@ -1,11 +1,18 @@
+#define _GNU_SOURCE
 #include <err.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "cyclic_buffer.h"
 
 #define BUF_SIZE 0x1000
+/* Not a multiple of the page size, so the buffer cannot be mirrored. */
+#define UNMIRRORED_SIZE (BUF_SIZE - 24)
+/* A multiple of 2 MiB, backed by huge pages if the kernel has them reserved
+ * and by regular pages marked for transparent huge pages otherwise. */
+#define HUGE_BUF_SIZE (2 * 1024 * 1024)
 
 struct test_setup {
     struct cyclic_buffer cb;
@@ -15,6 +22,13 @@ struct test_setup {
     char buf_out[BUF_SIZE];
 } test_setup;
 
+/* The suite runs with a mirrored buffer of `BUF_SIZE` and a plain one. */
+static size_t buf_size = BUF_SIZE;
+
+/* Either the plain or the vectored variants are tested. */
+static ssize_t (*cb_read)(int, struct cyclic_buffer*, size_t) = cyclic_buffer_read;
+static ssize_t (*cb_write)(int, struct cyclic_buffer*, size_t) = cyclic_buffer_write;
+
 static size_t min(size_t a, size_t b) {
     return a < b ? a : b;
 }
@@ -26,7 +40,7 @@ static void assert_size_equal(ssize_t expected, ssize_t actual, char* msg) {
 }
 
 static void assert_buffers_match(struct test_setup* setup) {
-    if (memcmp(setup->buf_in, setup->buf_out, BUF_SIZE) != 0) {
+    if (memcmp(setup->buf_in, setup->buf_out, buf_size) != 0) {
         err(3, "Output data does not match input buffer data");
     }
 }
@@ -35,7 +49,7 @@ static void check_cb_invariants(struct test_setup* setup, size_t expected_data_s
     struct cyclic_buffer* cb = &setup->cb;
     assert_size_equal(expected_data_size, cyclic_buffer_data_size(cb), "Data");
 
-    size_t expected_free_space = BUF_SIZE - expected_data_size;
+    size_t expected_free_space = cb->size - expected_data_size;
     assert_size_equal(expected_free_space, cyclic_buffer_free_size(cb), "Free space");
 }
 
@@ -43,7 +57,7 @@ static ssize_t read_into_cb(int pipe, struct cyclic_buffer* cb, size_t size) {
     size_t free_space = cyclic_buffer_free_size(cb);
     size_t expected_read = min(free_space, size);
     char* begin = cb->begin;
-    int ret = cyclic_buffer_read(pipe, cb, size);
+    int ret = cb_read(pipe, cb, size);
     if (ret < 0) {
         errx(4, "'cyclic_buffer_read' failed with error code: %zd", ret);
     }
@@ -74,7 +88,7 @@ static ssize_t write_from_cb(int pipe, struct cyclic_buffer* cb, size_t size) {
     size_t available_data = cyclic_buffer_data_size(cb);
     size_t expected_write = min(available_data, size);
     char* end = cb->end;
-    int ret = cyclic_buffer_write(pipe, cb, size);
+    int ret = cb_write(pipe, cb, size);
     if (ret < 0) {
         errx(8, "'cyclic_buffer_write' failed with error code: %zd", ret);
     }
@@ -110,17 +124,21 @@ static void close_pipe(int p[2]) {
 static void run_test(char* test_name, void (*test_block)(struct test_setup*)) {
     printf("Running test: %s ", test_name);
     struct test_setup setup;
-    if (cyclic_buffer_init(&setup.cb, BUF_SIZE) < 0) {
+    if (cyclic_buffer_init(&setup.cb, buf_size) < 0) {
         err(42, "'cyclic_buffer_init' failed");
     }
+    if (setup.cb.mirrored != (buf_size == BUF_SIZE)) {
+        errx(42, "Buffer of size %zu is %smirrored", buf_size,
+             setup.cb.mirrored ? "" : "not ");
+    }
     if (pipe(setup.p_in) < 0) {
         err(42, "pipe in");
     }
     if (pipe(setup.p_out) < 0) {
         err(42, "pipe out");
     }
-    memset(setup.buf_in, 0, BUF_SIZE);
-    memset(setup.buf_out, 0, BUF_SIZE);
+    memset(setup.buf_in, 0, buf_size);
+    memset(setup.buf_out, 0, buf_size);
     (*test_block)(&setup);
     close_pipe(setup.p_in);
     close_pipe(setup.p_out);
@@ -132,44 +150,44 @@ static void run_test(char* test_name, void (*test_block)(struct test_setup*)) {
 
 void test_empty_buffer(struct test_setup* setup) {
     check_cb_invariants(setup, 0);
-    assert_size_equal(0, pipe_from_cb(setup, BUF_SIZE), "Read");
+    assert_size_equal(0, pipe_from_cb(setup, buf_size), "Read");
     check_cb_invariants(setup, 0);
 }
 
 void test_full_buffer(struct test_setup* setup) {
-    memset(setup->buf_in, 'a', BUF_SIZE);
-    assert_size_equal(BUF_SIZE, pipe_to_cb(setup, BUF_SIZE), "Write");
-    check_cb_invariants(setup, BUF_SIZE);
+    memset(setup->buf_in, 'a', buf_size);
+    assert_size_equal(buf_size, pipe_to_cb(setup, buf_size), "Write");
+    check_cb_invariants(setup, buf_size);
 
-    assert_size_equal(0, pipe_to_cb(setup, BUF_SIZE), "Write");
-    check_cb_invariants(setup, BUF_SIZE);
+    assert_size_equal(0, pipe_to_cb(setup, buf_size), "Write");
+    check_cb_invariants(setup, buf_size);
 }
 
 void test_more_data_in_pipe_than_capacity(struct test_setup* setup) {
-    memset(setup->buf_in, 'a', BUF_SIZE);
-    assert_size_equal(BUF_SIZE, pipe_to_cb(setup, BUF_SIZE), "Write");
-    assert_size_equal(0, pipe_to_cb(setup, BUF_SIZE), "Write");
-    check_cb_invariants(setup, BUF_SIZE);
+    memset(setup->buf_in, 'a', buf_size);
+    assert_size_equal(buf_size, pipe_to_cb(setup, buf_size), "Write");
+    assert_size_equal(0, pipe_to_cb(setup, buf_size), "Write");
+    check_cb_invariants(setup, buf_size);
 
     assert_size_equal(42, pipe_from_cb(setup, 42), "Read");
-    check_cb_invariants(setup, BUF_SIZE - 42);
-    memset(setup->buf_in, 0, BUF_SIZE);
+    check_cb_invariants(setup, buf_size - 42);
+    memset(setup->buf_in, 0, buf_size);
     memset(setup->buf_in, 'a', 42);
     assert_buffers_match(setup);
 
-    assert_size_equal(42, read_into_cb(setup->p_in[0], &setup->cb, BUF_SIZE), "Read remaining from pipe");
-    check_cb_invariants(setup, BUF_SIZE);
-    assert_size_equal(BUF_SIZE, pipe_from_cb(setup, BUF_SIZE), "Read");
+    assert_size_equal(42, read_into_cb(setup->p_in[0], &setup->cb, buf_size), "Read remaining from pipe");
+    check_cb_invariants(setup, buf_size);
+    assert_size_equal(buf_size, pipe_from_cb(setup, buf_size), "Read");
     check_cb_invariants(setup, 0);
-    memset(setup->buf_in, 'a', BUF_SIZE);
+    memset(setup->buf_in, 'a', buf_size);
     assert_buffers_match(setup);
 
-    memset(setup->buf_out, 0, BUF_SIZE);
-    assert_size_equal(BUF_SIZE - 42, read_into_cb(setup->p_in[0], &setup->cb, BUF_SIZE - 42), "Read remaining from pipe");
-    check_cb_invariants(setup, BUF_SIZE - 42);
-    assert_size_equal(BUF_SIZE - 42, pipe_from_cb(setup, BUF_SIZE - 42), "Read");
-    memset(setup->buf_in, 0, BUF_SIZE);
-    memset(setup->buf_in, 'a', BUF_SIZE - 42);
+    memset(setup->buf_out, 0, buf_size);
+    assert_size_equal(buf_size - 42, read_into_cb(setup->p_in[0], &setup->cb, buf_size - 42), "Read remaining from pipe");
+    check_cb_invariants(setup, buf_size - 42);
+    assert_size_equal(buf_size - 42, pipe_from_cb(setup, buf_size - 42), "Read");
+    memset(setup->buf_in, 0, buf_size);
+    memset(setup->buf_in, 'a', buf_size - 42);
     assert_buffers_match(setup);
 }
 
@@ -177,28 +195,28 @@ void test_buffer_with_some_data(struct test_setup* setup) {
     memset(setup->buf_in, 'a', 7);
     assert_size_equal(7, pipe_to_cb(setup, 7), "Write");
     check_cb_invariants(setup, 7);
-    assert_size_equal(7, pipe_from_cb(setup, BUF_SIZE), "Read");
+    assert_size_equal(7, pipe_from_cb(setup, buf_size), "Read");
     check_cb_invariants(setup, 0);
-    assert_size_equal(0, pipe_from_cb(setup, BUF_SIZE), "Read");
+    assert_size_equal(0, pipe_from_cb(setup, buf_size), "Read");
     check_cb_invariants(setup, 0);
     assert_buffers_match(setup);
 }
 
 void test_buffer_never_empty(struct test_setup* setup) {
-    memset(setup->buf_in, 'a', BUF_SIZE);
-    assert_size_equal(BUF_SIZE, pipe_to_cb(setup, BUF_SIZE), "Write");
-    check_cb_invariants(setup, BUF_SIZE);
-    assert_size_equal(BUF_SIZE / 2 - 42, pipe_from_cb(setup, BUF_SIZE / 2 - 42), "Read");
-    check_cb_invariants(setup, BUF_SIZE / 2 + 42);
-    memset(setup->buf_in, 0, BUF_SIZE);
-    memset(setup->buf_in, 'a', BUF_SIZE / 2 - 42);
+    memset(setup->buf_in, 'a', buf_size);
+    assert_size_equal(buf_size, pipe_to_cb(setup, buf_size), "Write");
+    check_cb_invariants(setup, buf_size);
+    assert_size_equal(buf_size / 2 - 42, pipe_from_cb(setup, buf_size / 2 - 42), "Read");
+    check_cb_invariants(setup, buf_size / 2 + 42);
+    memset(setup->buf_in, 0, buf_size);
+    memset(setup->buf_in, 'a', buf_size / 2 - 42);
     assert_buffers_match(setup);
-    assert_size_equal(BUF_SIZE / 2, pipe_from_cb(setup, BUF_SIZE / 2), "Read");
+    assert_size_equal(buf_size / 2, pipe_from_cb(setup, buf_size / 2), "Read");
     check_cb_invariants(setup, 42);
-    memset(setup->buf_in, 'a', BUF_SIZE / 2);
+    memset(setup->buf_in, 'a', buf_size / 2);
     assert_buffers_match(setup);
     // run for 24 rounds, this should force crossing the boundary at different points in the data
-    int batch_size = BUF_SIZE - BUF_SIZE / 24;
+    int batch_size = buf_size - buf_size / 24;
     for(int i = 1; i < 25; i++) {
         memset(setup->buf_in, 'a' + i, batch_size);
         assert_size_equal(batch_size, pipe_to_cb(setup, batch_size), "Batch write");
@@ -210,16 +228,207 @@ void test_buffer_never_empty(struct test_setup* setup) {
     }
 }
 
-int main(void) {
-    setbuf(stdin, NULL);
-    setbuf(stdout, NULL);
-    setbuf(stderr, NULL);
+void test_mirrored_buffer_is_contiguous(struct test_setup* setup) {
+    memset(setup->buf_in, 'a', buf_size);
+    assert_size_equal(buf_size, pipe_to_cb(setup, buf_size), "Write");
+    assert_size_equal(buf_size - 42, pipe_from_cb(setup, buf_size - 42), "Read");
+    check_cb_invariants(setup, 42);
+
+    // the data now wraps around the end of the buffer
+    memset(setup->buf_in, 'b', buf_size - 42);
+    assert_size_equal(buf_size - 42, pipe_to_cb(setup, buf_size - 42), "Write");
+    check_cb_invariants(setup, buf_size);
+    if (memcmp(setup->cb.begin, "aa", 2) != 0
+            || setup->cb.begin[42] != 'b'
+            || setup->cb.begin[buf_size - 1] != 'b') {
+        errx(12, "Data is not contiguous");
+    }
+
+    assert_size_equal(buf_size, pipe_from_cb(setup, buf_size), "Read");
+    check_cb_invariants(setup, 0);
+    memset(setup->buf_in, 'b', buf_size);
+    memset(setup->buf_in, 'a', 42);
+    assert_buffers_match(setup);
+}
+
+void test_discard_oldest(struct test_setup* setup) {
+    memset(setup->buf_in, 'a', 42);
+    memset(setup->buf_in + 42, 'b', buf_size - 42);
+    assert_size_equal(buf_size, pipe_to_cb(setup, buf_size), "Write");
+    assert_size_equal(42, cyclic_buffer_discard(&setup->cb, 42), "Discard");
+    check_cb_invariants(setup, buf_size - 42);
+
+    // overwrite the dropped bytes, the data wraps around the end of the buffer
+    memset(setup->buf_in, 'c', 42);
+    assert_size_equal(42, pipe_to_cb(setup, 42), "Write");
+    check_cb_invariants(setup, buf_size);
+
+    assert_size_equal(buf_size - 42, pipe_from_cb(setup, buf_size - 42), "Read");
+    memset(setup->buf_in, 'b', buf_size - 42);
+    if (memcmp(setup->buf_in, setup->buf_out, buf_size - 42) != 0) {
+        errx(13, "Data was not discarded from the beginning");
+    }
+
+    assert_size_equal(42, cyclic_buffer_discard(&setup->cb, buf_size), "Discard");
+    check_cb_invariants(setup, 0);
+    assert_size_equal(0, cyclic_buffer_discard(&setup->cb, 1), "Discard");
+}
+
+void test_resize_keeps_data(struct test_setup* setup) {
+    memset(setup->buf_in, 'a', buf_size);
+    assert_size_equal(buf_size, pipe_to_cb(setup, buf_size), "Write");
+    assert_size_equal(buf_size - 42, pipe_from_cb(setup, buf_size - 42), "Read");
+
+    // the data now wraps around the end of the buffer
+    memset(setup->buf_in, 'b', buf_size - 42);
+    assert_size_equal(buf_size - 42, pipe_to_cb(setup, buf_size - 42), "Write");
+    if (cyclic_buffer_resize(&setup->cb, buf_size / 2) == 0) {
+        errx(14, "Buffer shrunk below its data size");
+    }
+    if (cyclic_buffer_resize(&setup->cb, 2 * buf_size) < 0) {
+        err(14, "'cyclic_buffer_resize' failed");
+    }
+    assert_size_equal(2 * buf_size, setup->cb.size, "Buffer");
+    check_cb_invariants(setup, buf_size);
+
+    assert_size_equal(buf_size, pipe_from_cb(setup, 2 * buf_size), "Read");
+    memset(setup->buf_in, 'b', buf_size);
+    memset(setup->buf_in, 'a', 42);
+    assert_buffers_match(setup);
+
+    if (cyclic_buffer_resize(&setup->cb, buf_size) < 0) {
+        err(14, "'cyclic_buffer_resize' failed");
+    }
+    check_cb_invariants(setup, 0);
+}
+
+void test_release_free_keeps_data(struct test_setup* setup) {
+    if (cyclic_buffer_release_free(&setup->cb) < 0) {
+        err(15, "'cyclic_buffer_release_free' failed");
+    }
+    memset(setup->buf_in, 'a', buf_size);
+    assert_size_equal(buf_size / 2, pipe_to_cb(setup, buf_size / 2), "Write");
+    if (cyclic_buffer_release_free(&setup->cb) < 0) {
+        err(15, "'cyclic_buffer_release_free' failed");
+    }
+    check_cb_invariants(setup, buf_size / 2);
+
+    assert_size_equal(buf_size / 2, pipe_to_cb(setup, buf_size / 2), "Write");
+    assert_size_equal(buf_size, pipe_from_cb(setup, buf_size), "Read");
+    assert_buffers_match(setup);
+}
+
+/* Checks that the buffer holds `len` bytes of `data`, contiguous if mirrored. */
+static void assert_cb_holds(struct cyclic_buffer* cb, const char* data, size_t len) {
+    struct iovec iov[2];
+
+    assert_size_equal(len, cyclic_buffer_peek(cb, cb->size, iov), "Peek");
+    if (memcmp(iov[0].iov_base, data, iov[0].iov_len) != 0
+            || memcmp(iov[1].iov_base, data + iov[0].iov_len, iov[1].iov_len) != 0) {
+        errx(16, "Buffer data does not match");
+    }
+    if (cb->mirrored && memcmp(cb->begin, data, len) != 0) {
+        errx(16, "Data of a mirrored buffer is not contiguous");
+    }
+}
+
+static void fill_cb(int fd, struct cyclic_buffer* cb, size_t len) {
+    while (len) {
+        ssize_t ret = cyclic_buffer_read(fd, cb, len);
+        if (ret <= 0) {
+            err(16, "'cyclic_buffer_read' failed");
+        }
+        len -= ret;
+    }
+}
 
+/* Data is too large for the pipes of the suite, a file stands in for them. */
+static void test_huge_buffer(void) {
+    printf("Running test: buffer of huge page size ");
+    size_t half = HUGE_BUF_SIZE / 2;
+    char* data = malloc(3 * half);
+    FILE* f = tmpfile();
+    struct cyclic_buffer cb;
+
+    if (!data || !f) {
+        err(16, "setup");
+    }
+    for (size_t i = 0; i < 3 * half; ++i) {
+        data[i] = i % 251;
+    }
+    if (fwrite(data, 1, 3 * half, f) != 3 * half || fflush(f) != 0) {
+        err(16, "fwrite");
+    }
+    rewind(f);
+
+    if (cyclic_buffer_init(&cb, HUGE_BUF_SIZE) < 0) {
+        err(16, "'cyclic_buffer_init' failed");
+    }
+    if (!cb.mirrored) {
+        errx(16, "Buffer of size %d is not mirrored", HUGE_BUF_SIZE);
+    }
+    fill_cb(fileno(f), &cb, HUGE_BUF_SIZE);
+    assert_size_equal(half, cyclic_buffer_discard(&cb, half), "Discard");
+    // the data now wraps around the end of the buffer
+    fill_cb(fileno(f), &cb, half);
+    assert_cb_holds(&cb, data + half, HUGE_BUF_SIZE);
+
+    if (cyclic_buffer_resize(&cb, 2 * HUGE_BUF_SIZE) < 0) {
+        err(16, "'cyclic_buffer_resize' failed");
+    }
+    assert_cb_holds(&cb, data + half, HUGE_BUF_SIZE);
+    if (cyclic_buffer_release_free(&cb) < 0) {
+        err(16, "'cyclic_buffer_release_free' failed");
+    }
+    assert_cb_holds(&cb, data + half, HUGE_BUF_SIZE);
+
+    if (cyclic_buffer_deinit(&cb) != 0) {
+        err(16, "'cyclic_buffer_deinit' failed");
+    }
+    fclose(f);
+    free(data);
+    printf("... PASSED\n");
+}
+
+static void run_tests(void) {
     run_test("emtpy buffer", test_empty_buffer);
     run_test("full buffer", test_full_buffer);
     run_test("buffer with some data", test_buffer_with_some_data);
     run_test("buffer never empty, pointer going around the boundary", test_buffer_never_empty);
     run_test("more data in pipe than capacity", test_more_data_in_pipe_than_capacity);
+    if (buf_size == BUF_SIZE) {
+        run_test("mirrored buffer is contiguous", test_mirrored_buffer_is_contiguous);
+    }
+    run_test("discarding oldest data", test_discard_oldest);
+    run_test("resizing keeps data", test_resize_keeps_data);
+    run_test("releasing free space keeps data", test_release_free_keeps_data);
+}
+
+int main(void) {
+    setbuf(stdin, NULL);
+    setbuf(stdout, NULL);
+    setbuf(stderr, NULL);
+
+    run_tests();
+
+    puts("Vectored I/O:");
+    cb_read = cyclic_buffer_readv;
+    cb_write = cyclic_buffer_writev;
+    run_tests();
+
+    puts("Not mirrored:");
+    buf_size = UNMIRRORED_SIZE;
+    cb_read = cyclic_buffer_read;
+    cb_write = cyclic_buffer_write;
+    run_tests();
+
+    puts("Not mirrored, vectored I/O:");
+    cb_read = cyclic_buffer_readv;
+    cb_write = cyclic_buffer_writev;
+    run_tests();
+
+    puts("Huge page size:");
+    test_huge_buffer();
 
     puts("Test OK");
     return 0;
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cyclic_buffer.h"
+
+#define BYTES_DEFAULT (256 * 1024 * 1024)
+#define SOCK_BUF_SIZE (4 * 1024 * 1024)
+#define IO_BUF_SIZE (1024 * 1024)
+#define TIMEOUT_SEC 120
+
+#define BUF_MIN_SIZE 0x1000
+#define BUF_MAX_SIZE (64 * 1024 * 1024)
+
+#define MAX_SIZES 16
+#define MAX_CHUNKS 16
+
+/*
+ * The buffer code is linked with `-Wl,--wrap=read,...`, so its syscalls go
+ * through the counting wrappers below. The benchmark itself calls the real
+ * functions.
+ */
+ssize_t __real_read(int fd, void* buf, size_t len);
+ssize_t __real_write(int fd, const void* buf, size_t len);
+ssize_t __real_readv(int fd, const struct iovec* iov, int iovcnt);
+ssize_t __real_writev(int fd, const struct iovec* iov, int iovcnt);
+
+static uint64_t g_syscalls = 0;
+
+ssize_t __wrap_read(int fd, void* buf, size_t len) {
+    ++g_syscalls;
+    return __real_read(fd, buf, len);
+}
+
+ssize_t __wrap_write(int fd, const void* buf, size_t len) {
+    ++g_syscalls;
+    return __real_write(fd, buf, len);
+}
+
+ssize_t __wrap_readv(int fd, const struct iovec* iov, int iovcnt) {
+    ++g_syscalls;
+    return __real_readv(fd, iov, iovcnt);
+}
+
+ssize_t __wrap_writev(int fd, const struct iovec* iov, int iovcnt) {
+    ++g_syscalls;
+    return __real_writev(fd, iov, iovcnt);
+}
+
+enum transport {
+    TRANSPORT_PIPE,
+    TRANSPORT_SOCKET,
+};
+
+enum pattern {
+    /* Buffer is drained after every read, so data never wraps. */
+    PATTERN_STREAM,
+    /* Buffer stays almost full and its data keeps wrapping around the end. */
+    PATTERN_WRAP,
+};
+
+enum api {
+    API_PLAIN,
+    API_VECTORED,
+};
+
+static const char* transport_names[] = {
+    [TRANSPORT_PIPE] = "pipe",
+    [TRANSPORT_SOCKET] = "socket",
+};
+
+static const char* pattern_names[] = {
+    [PATTERN_STREAM] = "stream",
+    [PATTERN_WRAP] = "wrap",
+};
+
+static const char* api_names[] = {
+    [API_PLAIN] = "plain",
+    [API_VECTORED] = "vectored",
+};
+
+struct bench {
+    enum transport transport;
+    enum pattern pattern;
+    enum api api;
+    size_t size;
+    size_t chunk;
+    size_t bytes;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void make_channel(enum transport transport, int fds[2]) {
+    if (transport == TRANSPORT_PIPE) {
+        if (pipe(fds) < 0) {
+            err(1, "pipe");
+        }
+        return;
+    }
+
+    int buf_size = SOCK_BUF_SIZE;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        err(1, "socketpair");
+    }
+    for (int i = 0; i < 2; ++i) {
+        setsockopt(fds[i], SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+        setsockopt(fds[i], SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+    }
+}
+
+/* Keeps writing to `fd` until the other side is closed. */
+static noreturn void producer(int fd) {
+    static char buf[IO_BUF_SIZE];
+
+    memset(buf, 'x', sizeof(buf));
+    while (__real_write(fd, buf, sizeof(buf)) > 0) {
+    }
+    _exit(0);
+}
+
+/* Reads and discards everything from `fd`. */
+static noreturn void consumer(int fd) {
+    static char buf[IO_BUF_SIZE];
+
+    while (__real_read(fd, buf, sizeof(buf)) > 0) {
+    }
+    _exit(0);
+}
+
+static pid_t spawn(void (*fn)(int), int fd, int other_fds[3]) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        err(1, "fork");
+    }
+    if (pid == 0) {
+        for (int i = 0; i < 3; ++i) {
+            close(other_fds[i]);
+        }
+        fn(fd);
+    }
+    return pid;
+}
+
+static void fill(int fd, struct cyclic_buffer* cb, size_t len,
+                 ssize_t (*cb_read)(int, struct cyclic_buffer*, size_t)) {
+    while (len > 0) {
+        ssize_t ret = cb_read(fd, cb, len);
+        if (ret <= 0) {
+            err(1, "cyclic buffer read");
+        }
+        len -= ret;
+    }
+}
+
+static size_t drain(int fd, struct cyclic_buffer* cb, size_t len,
+                    ssize_t (*cb_write)(int, struct cyclic_buffer*, size_t)) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t ret = cb_write(fd, cb, len - done);
+        if (ret <= 0) {
+            err(1, "cyclic buffer write");
+        }
+        done += ret;
+    }
+    return done;
+}
+
+static void run(struct bench* bench) {
+    ssize_t (*cb_read)(int, struct cyclic_buffer*, size_t) = cyclic_buffer_read;
+    ssize_t (*cb_write)(int, struct cyclic_buffer*, size_t) = cyclic_buffer_write;
+    struct cyclic_buffer cb;
+    int in[2], out[2];
+
+    if (bench->api == API_VECTORED) {
+        cb_read = cyclic_buffer_readv;
+        cb_write = cyclic_buffer_writev;
+    }
+    if (cyclic_buffer_init(&cb, bench->size) < 0) {
+        err(1, "cyclic_buffer_init");
+    }
+    make_channel(bench->transport, in);
+    make_channel(bench->transport, out);
+
+    pid_t producer_pid = spawn(producer, in[1], (int[3]){ in[0], out[0], out[1] });
+    pid_t consumer_pid = spawn(consumer, out[0], (int[3]){ in[0], in[1], out[1] });
+    close(in[1]);
+    close(out[0]);
+
+    size_t chunk = bench->chunk;
+    size_t backlog = 0;
+    if (bench->pattern == PATTERN_WRAP) {
+        /* Shift the data by half a chunk, so that chunks straddle the end. */
+        backlog = bench->size - chunk;
+        fill(in[0], &cb, backlog + chunk / 2, cb_read);
+        drain(out[1], &cb, chunk / 2, cb_write);
+    }
+
+    size_t moved = 0;
+    g_syscalls = 0;
+    uint64_t start = now_ns();
+    while (moved < bench->bytes) {
+        fill(in[0], &cb, chunk, cb_read);
+        moved += drain(out[1], &cb, cyclic_buffer_data_size(&cb) - backlog, cb_write);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    close(in[0]);
+    close(out[1]);
+    if (waitpid(producer_pid, NULL, 0) < 0 || waitpid(consumer_pid, NULL, 0) < 0) {
+        err(1, "waitpid");
+    }
+    if (cyclic_buffer_deinit(&cb) < 0) {
+        err(1, "cyclic_buffer_deinit");
+    }
+
+    double sec = elapsed / 1e9;
+    double mib = moved / (1024.0 * 1024.0);
+    printf("%s,%s,%s,%zu,%zu,%d,%zu,%.6f,%.1f,%.2f\n",
+           api_names[bench->api], transport_names[bench->transport],
+           pattern_names[bench->pattern], bench->size, chunk, cb.mirrored,
+           moved, sec, mib / sec, g_syscalls / mib);
+    fflush(stdout);
+}
+
+static size_t parse_list(char* arg, const char* what, long* out, size_t max,
+                         long (*parse)(const char*)) {
+    size_t len = 0;
+
+    for (char* tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+        if (len == max) {
+            errx(1, "Too many %s", what);
+        }
+        if ((out[len++] = parse(tok)) < 0) {
+            errx(1, "Invalid %s: %s", what, tok);
+        }
+    }
+    return len;
+}
+
+/* Accepts a `k` or `m` suffix. */
+static long parse_bytes(const char* arg) {
+    char* end = NULL;
+    long bytes = strtol(arg, &end, 0);
+
+    if (*end == 'k' || *end == 'K') {
+        bytes *= 1024;
+    } else if (*end == 'm' || *end == 'M') {
+        bytes *= 1024 * 1024;
+    } else if (*end) {
+        return -1;
+    }
+    return bytes;
+}
+
+static long parse_size(const char* arg) {
+    long size = parse_bytes(arg);
+    return size >= BUF_MIN_SIZE && size <= BUF_MAX_SIZE ? size : -1;
+}
+
+static long parse_chunk(const char* arg) {
+    long chunk = parse_bytes(arg);
+    return chunk > 0 && chunk <= BUF_MAX_SIZE ? chunk : -1;
+}
+
+static noreturn void usage(const char* name) {
+    fprintf(stderr,
+            "Usage: %s [-b bytes] [-s size,...] [-c chunk,...] [-p] [-S] [-w] [-W] [-v] [-V]\n"
+            "  -b  bytes moved through the buffer in each run (default %d)\n"
+            "  -s  buffer sizes, %d to %d bytes (default 4k,64k,1m,16m,64m)\n"
+            "  -c  chunk sizes (default 512,4k,64k)\n"
+            "  -p  only pipes, -S  only socket pairs\n"
+            "  -w  only the streaming pattern, -W  only the wrapping pattern\n"
+            "  -v  only plain read/write, -V  only readv/writev\n"
+            "Sizes accept a k or m suffix, buffers of sizes that are not a multiple\n"
+            "of the page size are not mirrored. Results are printed as CSV.\n",
+            name, BYTES_DEFAULT, BUF_MIN_SIZE, BUF_MAX_SIZE);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    long sizes[MAX_SIZES] = { 4 << 10, 64 << 10, 1 << 20, 16 << 20, 64 << 20 };
+    long chunks[MAX_CHUNKS] = { 512, 4 << 10, 64 << 10 };
+    size_t sizes_len = 5, chunks_len = 3;
+    bool transports[] = { true, true };
+    bool patterns[] = { true, true };
+    bool apis[] = { true, true };
+    size_t bytes = BYTES_DEFAULT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:s:c:pSwWvV")) != -1) {
+        switch (opt) {
+            case 'b':
+                bytes = parse_bytes(optarg);
+                break;
+            case 's':
+                sizes_len = parse_list(optarg, "sizes", sizes, MAX_SIZES, parse_size);
+                break;
+            case 'c':
+                chunks_len = parse_list(optarg, "chunks", chunks, MAX_CHUNKS, parse_chunk);
+                break;
+            case 'p':
+                transports[TRANSPORT_SOCKET] = false;
+                break;
+            case 'S':
+                transports[TRANSPORT_PIPE] = false;
+                break;
+            case 'w':
+                patterns[PATTERN_WRAP] = false;
+                break;
+            case 'W':
+                patterns[PATTERN_STREAM] = false;
+                break;
+            case 'v':
+                apis[API_VECTORED] = false;
+                break;
+            case 'V':
+                apis[API_PLAIN] = false;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (!bytes || (long)bytes < 0) {
+        usage(argv[0]);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("api,transport,pattern,buf_size,chunk,mirrored,bytes,seconds,mib_per_s,syscalls_per_mib\n");
+    fflush(stdout);
+
+    for (int a = API_PLAIN; a <= API_VECTORED; ++a) {
+        for (int t = TRANSPORT_PIPE; t <= TRANSPORT_SOCKET; ++t) {
+            for (int p = PATTERN_STREAM; p <= PATTERN_WRAP; ++p) {
+                for (size_t s = 0; s < sizes_len; ++s) {
+                    for (size_t c = 0; c < chunks_len; ++c) {
+                        struct bench bench = {
+                            .transport = t,
+                            .pattern = p,
+                            .api = a,
+                            .size = sizes[s],
+                            .chunk = chunks[c],
+                            .bytes = bytes,
+                        };
+
+                        if (!apis[a] || !transports[t] || !patterns[p]
+                                || bench.chunk > bench.size) {
+                            continue;
+                        }
+
+                        alarm(TIMEOUT_SEC);
+                        run(&bench);
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,474 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <err.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <netpacket/packet.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "forward.h"
+#include "network.h"
+
+#define FRAMES_DEFAULT 100000
+#define WINDOW_DEFAULT 64
+#define SOCK_BUF_SIZE (4 * 1024 * 1024)
+#define TIMEOUT_SEC 120
+
+#define TAP_MTU 65521
+#define ETH_HDR_SIZE 14
+#define ETH_P_BENCH 0x88b5
+
+#define MAX_SIZES 16
+#define MAX_MODES 3
+
+/* Follows the Ethernet header of every frame. */
+struct frame_hdr {
+    uint64_t seq;
+    uint64_t ts;
+};
+
+#define FRAME_MIN_SIZE (ETH_HDR_SIZE + sizeof(struct frame_hdr))
+#define FRAME_MAX_SIZE (64 * 1024)
+
+struct bench {
+    enum fwd_mode mode;
+    uint32_t size;
+    /* Tap to port if set, port to tap otherwise. */
+    bool tx;
+    /* Splice frames to the port, see `FWD_SPLICE`. */
+    bool splice;
+    bool tap;
+    /* The port is a pseudo-terminal instead of a socket pair. */
+    bool pty;
+    size_t frames;
+    size_t window;
+
+    /* Frames are written to `src_fd` and come out of `dst_fd`. */
+    int src_fd;
+    int dst_fd;
+    /* Length prefix size of the respective side, 0 for packets. */
+    uint32_t src_hdr_sz;
+    uint32_t dst_hdr_sz;
+
+    atomic_size_t received;
+    uint64_t* lat;
+};
+
+static const char* mode_names[] = {
+    [FWD_MODE_BLOCKING] = "blocking",
+    [FWD_MODE_SQPOLL] = "sqpoll",
+    [FWD_MODE_ADAPTIVE] = "adaptive",
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void readn(int fd, void* buf, size_t len) {
+    while (len > 0) {
+        ssize_t ret = read(fd, buf, len);
+        if (ret <= 0) {
+            err(1, "read");
+        }
+        buf = (char*)buf + ret;
+        len -= ret;
+    }
+}
+
+static void writen(int fd, const void* buf, size_t len) {
+    while (len > 0) {
+        ssize_t ret = write(fd, buf, len);
+        if (ret <= 0) {
+            err(1, "write");
+        }
+        buf = (const char*)buf + ret;
+        len -= ret;
+    }
+}
+
+static void set_sock_bufs(int fd) {
+    int size = SOCK_BUF_SIZE;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Length prefixes are little-endian, as on the virtio-serial ports. */
+static void put_len(char* buf, uint32_t hdr_sz, uint32_t len) {
+    for (uint32_t i = 0; i < hdr_sz; ++i) {
+        buf[i] = (char)(len >> (8 * i));
+    }
+}
+
+static uint32_t get_len(const char* buf, uint32_t hdr_sz) {
+    uint32_t len = 0;
+    for (uint32_t i = 0; i < hdr_sz; ++i) {
+        len |= (uint32_t)(uint8_t)buf[i] << (8 * i);
+    }
+    return len;
+}
+
+static int sender(void* data) {
+    struct bench* bench = data;
+    uint32_t hdr_sz = bench->src_hdr_sz;
+    char* buf = calloc(1, hdr_sz + bench->size);
+    char* frame = buf + hdr_sz;
+    struct frame_hdr hdr;
+
+    if (!buf) {
+        err(1, "calloc");
+    }
+
+    /* Broadcast, so the frames reach packet sockets on the tap */
+    memset(frame, 0xff, 6);
+    memset(frame + 6, 0x02, 6);
+    frame[12] = ETH_P_BENCH >> 8;
+    frame[13] = ETH_P_BENCH & 0xff;
+    put_len(buf, hdr_sz, bench->size);
+
+    for (size_t i = 0; i < bench->frames; ++i) {
+        while (i - atomic_load(&bench->received) >= bench->window) {
+            thrd_yield();
+        }
+        hdr.seq = i;
+        hdr.ts = now_ns();
+        memcpy(frame + ETH_HDR_SIZE, &hdr, sizeof(hdr));
+        writen(bench->src_fd, buf, hdr_sz + bench->size);
+    }
+
+    free(buf);
+    return 0;
+}
+
+/* Returns the length of the next frame read from the destination. */
+static uint32_t recv_frame(struct bench* bench, char* buf) {
+    ssize_t ret;
+
+    if (bench->dst_hdr_sz) {
+        char len[sizeof(uint32_t)];
+        readn(bench->dst_fd, len, bench->dst_hdr_sz);
+        uint32_t sz = get_len(len, bench->dst_hdr_sz);
+        if (sz > FRAME_MAX_SIZE) {
+            errx(1, "Invalid frame length: %u", sz);
+        }
+        readn(bench->dst_fd, buf, sz);
+        return sz;
+    }
+
+    if ((ret = read(bench->dst_fd, buf, FRAME_MAX_SIZE)) < 0) {
+        err(1, "read");
+    }
+    return ret;
+}
+
+static void receiver(struct bench* bench) {
+    char* buf = malloc(FRAME_MAX_SIZE);
+    struct frame_hdr hdr;
+    size_t i = 0;
+
+    if (!buf) {
+        err(1, "malloc");
+    }
+
+    while (i < bench->frames) {
+        uint32_t len = recv_frame(bench, buf);
+
+        /* The kernel sends its own frames through the tap */
+        if (len < FRAME_MIN_SIZE
+                || (uint8_t)buf[12] != ETH_P_BENCH >> 8
+                || (uint8_t)buf[13] != (ETH_P_BENCH & 0xff)) {
+            continue;
+        }
+        if (len != bench->size) {
+            errx(1, "Frame %zu: length %u, expected %u", i, len, bench->size);
+        }
+
+        memcpy(&hdr, buf + ETH_HDR_SIZE, sizeof(hdr));
+        if (hdr.seq != i) {
+            errx(1, "Frame %zu: got frame %lu", i, (unsigned long)hdr.seq);
+        }
+        bench->lat[i++] = now_ns() - hdr.ts;
+        atomic_store(&bench->received, i);
+    }
+
+    free(buf);
+}
+
+/* Creates a tap with a packet socket bound to it, which stands in for the
+ * kernel's side of the device. */
+static void setup_tap(int* tap_fd, int* sock_fd) {
+    char name[IFNAMSIZ] = "bench%d";
+    struct sockaddr_ll addr = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_BENCH),
+    };
+
+    if ((*tap_fd = net_create_tap(name, 0, 0)) < 0) {
+        errx(1, "Cannot create a tap: %s", strerror(-*tap_fd));
+    }
+    if (net_if_mtu(name, TAP_MTU) < 0 || net_if_up(name, 1) < 0) {
+        errx(1, "Cannot configure %s", name);
+    }
+
+    if ((*sock_fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_BENCH))) < 0) {
+        err(1, "socket");
+    }
+    addr.sll_ifindex = if_nametoindex(name);
+    if (bind(*sock_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        err(1, "bind");
+    }
+    set_sock_bufs(*sock_fd);
+}
+
+/* A pseudo-terminal stands in for a virtio-serial port, i.e. a character
+ * device which copies the pages spliced to it. The forwarder gets the master,
+ * the terminal is switched to raw mode to pass frames unchanged. */
+static void setup_pty(int* term_fd, int* master_fd) {
+    struct termios tio;
+
+    if ((*master_fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0
+            || grantpt(*master_fd) < 0 || unlockpt(*master_fd) < 0) {
+        err(1, "posix_openpt");
+    }
+    if ((*term_fd = open(ptsname(*master_fd), O_RDWR | O_NOCTTY)) < 0) {
+        err(1, "open");
+    }
+    if (tcgetattr(*term_fd, &tio) < 0) {
+        err(1, "tcgetattr");
+    }
+    cfmakeraw(&tio);
+    if (tcsetattr(*term_fd, TCSANOW, &tio) < 0) {
+        err(1, "tcsetattr");
+    }
+}
+
+static const char* dir_name(const struct bench* bench) {
+    if (!bench->tx) {
+        return "rx";
+    }
+    return bench->splice ? "txs" : "tx";
+}
+
+static void run(struct bench* bench) {
+    int pkt[2], str[2];
+    int flags, id;
+    uint32_t hdr_sz = bench->size > UINT16_MAX ? 4 : 2;
+    thrd_t th;
+
+    /* pkt[0] and str[0] are the benchmark's ends, the forwarder gets the
+     * other ones */
+    if (bench->tap) {
+        setup_tap(&pkt[1], &pkt[0]);
+    } else if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pkt) < 0) {
+        err(1, "socketpair");
+    }
+    if (bench->pty) {
+        setup_pty(&str[0], &str[1]);
+    } else if (socketpair(AF_UNIX, SOCK_STREAM, 0, str) < 0) {
+        err(1, "socketpair");
+    }
+    for (int i = 0; i < 2; ++i) {
+        if (!bench->pty) {
+            set_sock_bufs(str[i]);
+        }
+        if (!bench->tap) {
+            set_sock_bufs(pkt[i]);
+        }
+    }
+
+    flags = hdr_sz == 4 ? FWD_LEN32 : 0;
+    if (bench->splice) {
+        flags |= FWD_SPLICE;
+    }
+    if (bench->tx) {
+        id = fwd_add(pkt[1], str[1], bench->size, flags | FWD_WRITE_HDR);
+        bench->src_fd = pkt[0];
+        bench->dst_fd = str[0];
+        bench->dst_hdr_sz = hdr_sz;
+    } else {
+        id = fwd_add(str[1], pkt[1], bench->size, flags | FWD_READ_HDR);
+        bench->src_fd = str[0];
+        bench->src_hdr_sz = hdr_sz;
+        bench->dst_fd = pkt[0];
+    }
+    if (id < 0) {
+        errx(1, "fwd_add: %s", strerror(-id));
+    }
+    if ((id = fwd_run(1, bench->mode, 50)) < 0) {
+        errx(1, "fwd_run: %s", strerror(-id));
+    }
+
+    if (!(bench->lat = malloc(bench->frames * sizeof(uint64_t)))) {
+        err(1, "malloc");
+    }
+
+    uint64_t start = now_ns();
+    if (thrd_create(&th, sender, bench) != thrd_success) {
+        errx(1, "thrd_create");
+    }
+    receiver(bench);
+    uint64_t elapsed = now_ns() - start;
+    thrd_join(th, NULL);
+
+    qsort(bench->lat, bench->frames, sizeof(uint64_t), cmp_u64);
+    double sec = elapsed / 1e9;
+    printf("%-9s %-3s %6u %12.0f %9.3f %9.1f %9.1f\n",
+           mode_names[bench->mode], dir_name(bench), bench->size,
+           bench->frames / sec, bench->frames * bench->size * 8 / sec / 1e9,
+           bench->lat[bench->frames / 2] / 1e3,
+           bench->lat[bench->frames * 99 / 100] / 1e3);
+    fflush(stdout);
+}
+
+static size_t parse_list(char* arg, const char* what, long* out, size_t max,
+                         long (*parse)(const char*)) {
+    size_t len = 0;
+
+    for (char* tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+        if (len == max) {
+            errx(1, "Too many %s", what);
+        }
+        if ((out[len++] = parse(tok)) < 0) {
+            errx(1, "Invalid %s: %s", what, tok);
+        }
+    }
+    return len;
+}
+
+static long parse_size(const char* arg) {
+    long size = strtol(arg, NULL, 0);
+    return size >= (long)FRAME_MIN_SIZE && size <= FRAME_MAX_SIZE ? size : -1;
+}
+
+static long parse_mode(const char* arg) {
+    for (size_t i = 0; i < sizeof(mode_names) / sizeof(*mode_names); ++i) {
+        if (!strcmp(arg, mode_names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static noreturn void usage(const char* name) {
+    fprintf(stderr,
+            "Usage: %s [-n frames] [-w window] [-s size,...] [-m mode,...] [-t] [-S]\n"
+            "  -n  frames forwarded in each run (default %d)\n"
+            "  -w  maximum number of frames in flight (default %d)\n"
+            "  -s  frame sizes, %zu to %d bytes (default 64,512,1514,9014,65536)\n"
+            "  -m  blocking, sqpoll, adaptive (default all)\n"
+            "  -t  forward a tap in a new user and network namespace instead\n"
+            "      of a socket pair\n"
+            "  -S  forward to a pseudo-terminal, which copies spliced pages like\n"
+            "      a virtio-serial port does, and add spliced tx runs (txs)\n",
+            name, FRAMES_DEFAULT, WINDOW_DEFAULT, FRAME_MIN_SIZE, FRAME_MAX_SIZE);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    long sizes[MAX_SIZES] = { 64, 512, 1514, 9014, 65536 };
+    long modes[MAX_MODES] = { FWD_MODE_BLOCKING, FWD_MODE_SQPOLL, FWD_MODE_ADAPTIVE };
+    size_t sizes_len = 5, modes_len = 3;
+    struct bench proto = {
+        .frames = FRAMES_DEFAULT,
+        .window = WINDOW_DEFAULT,
+    };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:w:s:m:tS")) != -1) {
+        switch (opt) {
+            case 'n':
+                proto.frames = strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                proto.window = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                sizes_len = parse_list(optarg, "sizes", sizes, MAX_SIZES, parse_size);
+                break;
+            case 'm':
+                modes_len = parse_list(optarg, "modes", modes, MAX_MODES, parse_mode);
+                break;
+            case 't':
+                proto.tap = true;
+                break;
+            case 'S':
+                proto.pty = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (!proto.frames || !proto.window) {
+        usage(argv[0]);
+    }
+
+    if (proto.tap && unshare(CLONE_NEWUSER | CLONE_NEWNET) < 0) {
+        err(1, "unshare");
+    }
+
+    printf("%-9s %-3s %6s %12s %9s %9s %9s\n",
+           "mode", "dir", "size", "pps", "Gbit/s", "p50 us", "p99 us");
+    fflush(stdout);
+
+    /* Forwarders cannot be stopped, so every run gets its own process */
+    for (size_t m = 0; m < modes_len; ++m) {
+        for (size_t s = 0; s < sizes_len; ++s) {
+            /* Copied tx, spliced tx and rx */
+            for (int dir = 0; dir < 3; ++dir) {
+                struct bench bench = proto;
+                bench.mode = modes[m];
+                bench.size = sizes[s];
+                bench.tx = dir < 2;
+                bench.splice = dir == 1;
+
+                if (bench.splice && !bench.pty) {
+                    continue;
+                }
+                if (bench.tap && bench.size > TAP_MTU + ETH_HDR_SIZE) {
+                    continue;
+                }
+
+                pid_t pid = fork();
+                if (pid < 0) {
+                    err(1, "fork");
+                }
+                if (pid == 0) {
+                    alarm(TIMEOUT_SEC);
+                    run(&bench);
+                    _exit(0);
+                }
+
+                int status;
+                if (waitpid(pid, &status, 0) < 0) {
+                    err(1, "waitpid");
+                }
+                if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+                    errx(1, "%s %s %u failed", mode_names[bench.mode],
+                         dir_name(&bench), bench.size);
+                }
+            }
+        }
+    }
+    return 0;
+}
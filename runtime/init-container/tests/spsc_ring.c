@@ -0,0 +1,152 @@
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+
+#include "spsc_ring.h"
+
+#define RING_SIZE 0x1000
+#define STRESS_BYTES (16 * 1024 * 1024)
+
+static void assert_size_equal(ssize_t expected, ssize_t actual, char* msg) {
+    if (expected != actual) {
+        errx(2, "%s size did not match. expected: %zd, actual: %zd", msg, expected, actual);
+    }
+}
+
+static void run_test(char* test_name, void (*test_block)(struct spsc_ring*)) {
+    printf("Running test: %s ", test_name);
+    struct spsc_ring ring;
+    if (spsc_ring_init(&ring, RING_SIZE) < 0) {
+        err(42, "'spsc_ring_init' failed");
+    }
+    (*test_block)(&ring);
+    if (spsc_ring_deinit(&ring) != 0) {
+        err(42, "'spsc_ring_deinit' failed");
+    }
+    printf("... PASSED\n");
+}
+
+void test_invalid_size(struct spsc_ring* ring) {
+    struct spsc_ring other;
+    if (spsc_ring_init(&other, RING_SIZE + 1) == 0 || errno != EINVAL) {
+        errx(3, "Ring of size not being a power of two was created");
+    }
+    assert_size_equal(0, spsc_ring_data_size(ring), "Data");
+    assert_size_equal(RING_SIZE, spsc_ring_free_size(ring), "Free space");
+}
+
+void test_push_pop_wraps(struct spsc_ring* ring) {
+    char in[RING_SIZE], out[RING_SIZE];
+
+    for (size_t i = 0; i < sizeof(in); ++i) {
+        in[i] = (char)i;
+    }
+    assert_size_equal(RING_SIZE - 42, spsc_ring_push(ring, in, RING_SIZE - 42), "Push");
+    assert_size_equal(RING_SIZE - 42, spsc_ring_pop(ring, out, RING_SIZE), "Pop");
+
+    // the data now wraps around the end of the ring
+    assert_size_equal(RING_SIZE, spsc_ring_push(ring, in, 2 * RING_SIZE), "Push");
+    assert_size_equal(0, spsc_ring_push(ring, in, 1), "Push into full ring");
+    assert_size_equal(RING_SIZE, spsc_ring_data_size(ring), "Data");
+    assert_size_equal(RING_SIZE, spsc_ring_pop(ring, out, RING_SIZE), "Pop");
+    assert_size_equal(0, spsc_ring_pop(ring, out, 1), "Pop from empty ring");
+    if (memcmp(in, out, RING_SIZE) != 0) {
+        errx(4, "Output data does not match input data");
+    }
+}
+
+void test_fd_io_wraps(struct spsc_ring* ring) {
+    char in[RING_SIZE], out[RING_SIZE];
+    int p_in[2], p_out[2];
+
+    if (pipe(p_in) < 0 || pipe(p_out) < 0) {
+        err(42, "pipe");
+    }
+    memset(in, 'a', sizeof(in));
+    assert_size_equal(RING_SIZE - 42, spsc_ring_push(ring, in, RING_SIZE - 42), "Push");
+    assert_size_equal(RING_SIZE - 42, spsc_ring_write(p_out[1], ring, RING_SIZE), "Ring write");
+    assert_size_equal(RING_SIZE - 42, read(p_out[0], out, RING_SIZE), "Pipe read");
+
+    memset(in, 'b', sizeof(in));
+    assert_size_equal(RING_SIZE, write(p_in[1], in, RING_SIZE), "Pipe write");
+    assert_size_equal(RING_SIZE, spsc_ring_read(p_in[0], ring, 2 * RING_SIZE), "Ring read");
+    assert_size_equal(RING_SIZE, spsc_ring_write(p_out[1], ring, RING_SIZE), "Ring write");
+    assert_size_equal(RING_SIZE, read(p_out[0], out, RING_SIZE), "Pipe read");
+    if (memcmp(in, out, RING_SIZE) != 0) {
+        errx(5, "Output data does not match input data");
+    }
+
+    close(p_in[0]);
+    close(p_in[1]);
+    close(p_out[0]);
+    close(p_out[1]);
+}
+
+static int producer(void* arg) {
+    struct spsc_ring* ring = arg;
+    uint8_t chunk[97];
+    uint64_t sent = 0;
+
+    while (sent < STRESS_BYTES) {
+        size_t len = sizeof(chunk);
+        if (len > STRESS_BYTES - sent) {
+            len = STRESS_BYTES - sent;
+        }
+        for (size_t i = 0; i < len; ++i) {
+            chunk[i] = (uint8_t)(sent + i);
+        }
+
+        size_t done = 0;
+        while (done < len) {
+            size_t ret = spsc_ring_push(ring, chunk + done, len - done);
+            if (!ret) {
+                thrd_yield();
+            }
+            done += ret;
+        }
+        sent += len;
+    }
+    return 0;
+}
+
+void test_concurrent_transfer(struct spsc_ring* ring) {
+    uint8_t chunk[61];
+    uint64_t received = 0;
+    thrd_t th;
+
+    if (thrd_create(&th, producer, ring) != thrd_success) {
+        errx(42, "thrd_create");
+    }
+    while (received < STRESS_BYTES) {
+        size_t len = spsc_ring_pop(ring, chunk, sizeof(chunk));
+        if (!len) {
+            thrd_yield();
+        }
+        for (size_t i = 0; i < len; ++i) {
+            if (chunk[i] != (uint8_t)(received + i)) {
+                errx(6, "Data corrupted at byte %llu", (unsigned long long)(received + i));
+            }
+        }
+        received += len;
+    }
+    thrd_join(th, NULL);
+    assert_size_equal(0, spsc_ring_data_size(ring), "Data");
+}
+
+int main(void) {
+    setbuf(stdin, NULL);
+    setbuf(stdout, NULL);
+    setbuf(stderr, NULL);
+
+    run_test("invalid size", test_invalid_size);
+    run_test("push and pop around the boundary", test_push_pop_wraps);
+    run_test("fd I/O around the boundary", test_fd_io_wraps);
+    run_test("concurrent producer and consumer", test_concurrent_transfer);
+
+    puts("Test OK");
+    return 0;
+}
@@ -1,9 +1,10 @@
-use futures::channel::mpsc;
+use futures::channel::{mpsc, oneshot};
 use futures::future::{BoxFuture, FutureExt};
-use futures::lock::Mutex;
 use futures::{SinkExt, StreamExt};
+use std::collections::HashMap;
 use std::path::Path;
-use std::sync::Arc;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
 use std::{io, marker::PhantomData};
 use tokio::{
     io::{split, AsyncWriteExt, ReadHalf, WriteHalf},
@@ -11,8 +12,8 @@ use tokio::{
     spawn, time,
 };
 
-pub use crate::response_parser::Notification;
-use crate::response_parser::{parse_one_response, GuestAgentMessage, Response, ResponseWithId};
+use crate::response_parser::{parse_one_response, GuestAgentMessage, ResponseWithId};
+pub use crate::response_parser::{Notification, Response};
 
 #[allow(clippy::enum_variant_names)]
 #[repr(u8)]
@@ -30,6 +31,9 @@ enum MsgType {
     MsgSyncFs,
     MsgNetCtl,
     MsgNetHost,
+    MsgNetStats,
+    MsgBatch,
+    MsgOutputCredit,
 }
 
 #[allow(clippy::enum_variant_names)]
@@ -81,11 +85,13 @@ enum SubMsgNetCtlType<'a> {
     SubMsgNetCtlGateway(&'a [u8]),
     SubMsgNetCtlIfAddr(&'a [u8]),
     SubMsgNetCtlIf(u16),
+    SubMsgNetCtlRateBps(u64),
+    SubMsgNetCtlRatePps(u64),
+    SubMsgNetCtlRateBurst(u32),
 }
 
 #[repr(u16)]
 enum SubMsgNetCtlFlags {
-    #[allow(unused)]
     Empty = 0,
     Add,
 }
@@ -96,11 +102,105 @@ enum SubMsgNetHostType<'a> {
     SubMsgNetHostEntry(&'a [u8], &'a [u8]),
 }
 
+#[allow(clippy::enum_variant_names)]
+enum SubMsgNetStatsType {
+    SubMsgEnd,
+}
+
+#[allow(clippy::enum_variant_names)]
+enum SubMsgBatchType<'a> {
+    SubMsgEnd,
+    /// Message type and its sub-messages, including the end marker.
+    SubMsgBatchItem(u8, &'a [u8]),
+}
+
+#[allow(clippy::enum_variant_names)]
+enum SubMsgOutputCreditType {
+    SubMsgEnd,
+    SubMsgOutputCreditId(u64),
+    SubMsgOutputCreditFd(u8),
+    SubMsgOutputCreditBytes(u64),
+    SubMsgOutputCreditChannel(u64),
+}
+
 #[allow(clippy::enum_variant_names)]
 pub enum RedirectFdType<'a> {
     RedirectFdFile(&'a [u8]),
     RedirectFdPipeBlocking(u64),
     RedirectFdPipeCyclic(u64),
+    /// Output is pushed with `Notification::OutputData`, up to the buffer
+    /// size at first and then as much as granted with `output_credit`.
+    RedirectFdPipeStream(u64),
+}
+
+pub const NET_STATS_DIR_TX: u8 = 0;
+pub const NET_STATS_DIR_RX: u8 = 1;
+/// Upper bounds of the frame size histogram buckets, the last one is open.
+pub const NET_STATS_HIST_BOUNDS: [u32; NET_STATS_HIST_LEN - 1] =
+    [64, 128, 256, 512, 1024, 1518, 9018];
+pub const NET_STATS_HIST_LEN: usize = 8;
+
+/// Counters of a single network forwarder in the guest, i.e. a queue of an
+/// interface in one direction. Sizes do not include length prefixes.
+#[derive(Clone, Debug, Default)]
+pub struct NetStats {
+    pub iface: u16,
+    pub dir: u8,
+    pub queue: u8,
+    pub frames: u64,
+    pub bytes: u64,
+    pub short_reads: u64,
+    pub write_retries: u64,
+    pub stall_ns: u64,
+    pub batches: u64,
+    pub batch_frames: u64,
+    pub wakeups: u64,
+    pub wake_ns_total: u64,
+    pub wake_ns_max: u64,
+    pub hist: [u64; NET_STATS_HIST_LEN],
+    /// Invalid frame lengths sent by the host, each stops the forwarder.
+    pub proto_errors: u64,
+}
+
+impl NetStats {
+    const SIZE: usize = 4 + 10 * 8 + NET_STATS_HIST_LEN * 8 + 8;
+
+    fn parse_all(buf: &[u8]) -> io::Result<Vec<NetStats>> {
+        if buf.len() % Self::SIZE != 0 {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "Invalid network statistics size",
+            ));
+        }
+        Ok(buf.chunks_exact(Self::SIZE).map(Self::parse).collect())
+    }
+
+    fn parse(buf: &[u8]) -> NetStats {
+        let mut u64s = buf[4..]
+            .chunks_exact(8)
+            .map(|b| u64::from_le_bytes(b.try_into().unwrap()));
+        let mut next = || u64s.next().unwrap();
+        let mut stats = NetStats {
+            iface: u16::from_le_bytes([buf[0], buf[1]]),
+            dir: buf[2],
+            queue: buf[3],
+            frames: next(),
+            bytes: next(),
+            short_reads: next(),
+            write_retries: next(),
+            stall_ns: next(),
+            batches: next(),
+            batch_frames: next(),
+            wakeups: next(),
+            wake_ns_total: next(),
+            wake_ns_max: next(),
+            hist: Default::default(),
+            proto_errors: 0,
+        };
+        stats.hist.iter_mut().for_each(|h| *h = next());
+        stats.proto_errors = next();
+        stats
+    }
 }
 
 struct Message<T> {
@@ -108,11 +208,37 @@ struct Message<T> {
     phantom: PhantomData<T>,
 }
 
+/// Requests sent to the guest and not answered yet, keyed by message ID.
+/// Once the connection fails, `error` is set and no new request is accepted.
+#[derive(Default)]
+struct Pending {
+    requests: HashMap<u64, oneshot::Sender<Response>>,
+    error: Option<(io::ErrorKind, String)>,
+}
+
+impl Pending {
+    fn error(&self) -> Option<io::Error> {
+        self.error
+            .as_ref()
+            .map(|(kind, msg)| io::Error::new(*kind, msg.clone()))
+    }
+
+    /// Records the connection error, dropping all requests in flight.
+    fn fail(&mut self, err: &io::Error) {
+        if self.error.is_none() {
+            self.error = Some((err.kind(), err.to_string()));
+        }
+        self.requests.clear();
+    }
+}
+
+/// Guest Agent client. Requests may be issued concurrently from many tasks:
+/// messages are written by a writer task, responses are matched to requests
+/// by their message ID, so they do not need to come back in order.
 pub struct GuestAgent {
-    stream: WriteHalf<UnixStream>,
-    last_msg_id: u64,
-    responses: mpsc::Receiver<ResponseWithId>,
-    responses_reader_handle: Option<tokio::task::JoinHandle<io::Error>>,
+    last_msg_id: AtomicU64,
+    messages: mpsc::UnboundedSender<Vec<u8>>,
+    pending: Arc<Mutex<Pending>>,
 }
 
 trait EncodeInto {
@@ -151,6 +277,18 @@ impl SubMsgTrait<SubMsgNetHostType<'_>> for SubMsgNetHostType<'_> {
     const TYPE: u8 = MsgType::MsgNetHost as u8;
 }
 
+impl SubMsgTrait<SubMsgNetStatsType> for SubMsgNetStatsType {
+    const TYPE: u8 = MsgType::MsgNetStats as u8;
+}
+
+impl SubMsgTrait<SubMsgBatchType<'_>> for SubMsgBatchType<'_> {
+    const TYPE: u8 = MsgType::MsgBatch as u8;
+}
+
+impl SubMsgTrait<SubMsgOutputCreditType> for SubMsgOutputCreditType {
+    const TYPE: u8 = MsgType::MsgOutputCredit as u8;
+}
+
 impl EncodeInto for u8 {
     fn encode_into(&self, buf: &mut Vec<u8>) {
         buf.extend(&self.to_le_bytes());
@@ -254,6 +392,10 @@ impl EncodeInto for RedirectFdType<'_> {
                 2u8.encode_into(buf);
                 size.encode_into(buf);
             }
+            RedirectFdType::RedirectFdPipeStream(size) => {
+                3u8.encode_into(buf);
+                size.encode_into(buf);
+            }
         }
     }
 }
@@ -346,6 +488,18 @@ impl EncodeInto for SubMsgNetCtlType<'_> {
                 6u8.encode_into(buf);
                 iface.encode_into(buf);
             }
+            SubMsgNetCtlType::SubMsgNetCtlRateBps(bps) => {
+                7u8.encode_into(buf);
+                bps.encode_into(buf);
+            }
+            SubMsgNetCtlType::SubMsgNetCtlRatePps(pps) => {
+                8u8.encode_into(buf);
+                pps.encode_into(buf);
+            }
+            SubMsgNetCtlType::SubMsgNetCtlRateBurst(burst_us) => {
+                9u8.encode_into(buf);
+                burst_us.encode_into(buf);
+            }
         }
     }
 }
@@ -365,6 +519,57 @@ impl EncodeInto for SubMsgNetHostType<'_> {
     }
 }
 
+impl EncodeInto for SubMsgNetStatsType {
+    fn encode_into(&self, buf: &mut Vec<u8>) {
+        match self {
+            SubMsgNetStatsType::SubMsgEnd => {
+                0u8.encode_into(buf);
+            }
+        }
+    }
+}
+
+impl EncodeInto for SubMsgBatchType<'_> {
+    fn encode_into(&self, buf: &mut Vec<u8>) {
+        match self {
+            SubMsgBatchType::SubMsgEnd => {
+                0u8.encode_into(buf);
+            }
+            SubMsgBatchType::SubMsgBatchItem(type_, submsgs) => {
+                1u8.encode_into(buf);
+                type_.encode_into(buf);
+                buf.extend(*submsgs);
+            }
+        }
+    }
+}
+
+impl EncodeInto for SubMsgOutputCreditType {
+    fn encode_into(&self, buf: &mut Vec<u8>) {
+        match self {
+            SubMsgOutputCreditType::SubMsgEnd => {
+                0u8.encode_into(buf);
+            }
+            SubMsgOutputCreditType::SubMsgOutputCreditId(id) => {
+                1u8.encode_into(buf);
+                id.encode_into(buf);
+            }
+            SubMsgOutputCreditType::SubMsgOutputCreditFd(fd) => {
+                2u8.encode_into(buf);
+                fd.encode_into(buf);
+            }
+            SubMsgOutputCreditType::SubMsgOutputCreditBytes(bytes) => {
+                3u8.encode_into(buf);
+                bytes.encode_into(buf);
+            }
+            SubMsgOutputCreditType::SubMsgOutputCreditChannel(bytes) => {
+                4u8.encode_into(buf);
+                bytes.encode_into(buf);
+            }
+        }
+    }
+}
+
 impl<T> Default for Message<T> {
     fn default() -> Self {
         Self {
@@ -388,24 +593,57 @@ where
     }
 }
 
-impl<T> AsRef<Vec<u8>> for Message<T> {
-    fn as_ref(&self) -> &Vec<u8> {
-        &self.buf
+impl<T> From<Message<T>> for Vec<u8> {
+    fn from(msg: Message<T>) -> Self {
+        msg.buf
     }
 }
 
 pub type RemoteCommandResult<T> = Result<T, /* exit code */ u32>;
 
+impl Response {
+    fn into_error<T>(self) -> io::Result<RemoteCommandResult<T>> {
+        match self {
+            Response::Err(code) => Ok(Err(code)),
+            _ => Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "Invalid response",
+            )),
+        }
+    }
+
+    pub fn into_ok(self) -> io::Result<RemoteCommandResult<()>> {
+        match self {
+            Response::Ok => Ok(Ok(())),
+            x => x.into_error(),
+        }
+    }
+
+    pub fn into_u64(self) -> io::Result<RemoteCommandResult<u64>> {
+        match self {
+            Response::OkU64(val) => Ok(Ok(val)),
+            x => x.into_error(),
+        }
+    }
+
+    pub fn into_bytes(self) -> io::Result<RemoteCommandResult<Vec<u8>>> {
+        match self {
+            Response::OkBytes(bytes) => Ok(Ok(bytes)),
+            x => x.into_error(),
+        }
+    }
+}
+
 fn reader<'f, F>(
-    agent: Arc<Mutex<GuestAgent>>,
+    agent: Arc<GuestAgent>,
     mut stream: ReadHalf<UnixStream>,
     mut notification_handler: F,
-    mut responses: mpsc::Sender<ResponseWithId>,
-) -> BoxFuture<'f, io::Error>
+) -> BoxFuture<'f, ()>
 where
-    F: FnMut(Notification, Arc<Mutex<GuestAgent>>) -> BoxFuture<'static, ()> + Send + 'static,
+    F: FnMut(Notification, Arc<GuestAgent>) -> BoxFuture<'static, ()> + Send + 'static,
 {
     let (mut tx, rx) = mpsc::channel(8);
+    let pending = agent.pending.clone();
     spawn(async move {
         rx.for_each(|n| notification_handler(n, agent.clone()))
             .await;
@@ -417,25 +655,52 @@ where
                     GuestAgentMessage::Notification(notification) => {
                         let _ = tx.send(notification).await;
                     }
-                    GuestAgentMessage::Response(resp) => {
-                        responses.send(resp).await.expect("failed to send response");
+                    GuestAgentMessage::Response(ResponseWithId { id, resp }) => {
+                        let request = pending.lock().unwrap().requests.remove(&id);
+                        match request {
+                            // The requester might have given up waiting.
+                            Some(request) => {
+                                let _ = request.send(resp);
+                            }
+                            None => log::warn!("Got response with unknown ID {}", id),
+                        }
                     }
                 },
-                Err(err) => return err,
+                Err(err) => {
+                    pending.lock().unwrap().fail(&err);
+                    return;
+                }
             }
         }
     }
     .boxed()
 }
 
+/// Writes queued messages, coalescing the ones queued at the same time.
+async fn writer(
+    mut stream: WriteHalf<UnixStream>,
+    mut messages: mpsc::UnboundedReceiver<Vec<u8>>,
+    pending: Arc<Mutex<Pending>>,
+) {
+    while let Some(mut buf) = messages.next().await {
+        while let Ok(Some(msg)) = messages.try_next() {
+            buf.extend(msg);
+        }
+        if let Err(err) = stream.write_all(&buf).await {
+            pending.lock().unwrap().fail(&err);
+            return;
+        }
+    }
+}
+
 impl GuestAgent {
     pub async fn connected<F, P>(
         path: P,
         timeout: u32,
         notification_handler: F,
-    ) -> io::Result<Arc<Mutex<GuestAgent>>>
+    ) -> io::Result<Arc<GuestAgent>>
     where
-        F: FnMut(Notification, Arc<Mutex<GuestAgent>>) -> BoxFuture<'static, ()> + Send + 'static,
+        F: FnMut(Notification, Arc<GuestAgent>) -> BoxFuture<'static, ()> + Send + 'static,
         P: AsRef<Path>,
     {
         let mut timeout_remaining = timeout;
@@ -443,23 +708,15 @@ impl GuestAgent {
             match UnixStream::connect(&path).await {
                 Ok(s) => {
                     let (stream_read, stream_write) = split(s);
-                    let (response_send, response_receive) = mpsc::channel(10);
-                    let ga = Arc::new(Mutex::new(GuestAgent {
-                        stream: stream_write,
-                        last_msg_id: 0,
-                        responses: response_receive,
-                        responses_reader_handle: None,
-                    }));
-                    let reader_handle = spawn(reader(
-                        ga.clone(),
-                        stream_read,
-                        notification_handler,
-                        response_send,
-                    ));
-                    ga.lock()
-                        .await
-                        .responses_reader_handle
-                        .replace(reader_handle);
+                    let (messages_send, messages_receive) = mpsc::unbounded();
+                    let pending = Arc::new(Mutex::new(Pending::default()));
+                    let ga = Arc::new(GuestAgent {
+                        last_msg_id: AtomicU64::new(0),
+                        messages: messages_send,
+                        pending: pending.clone(),
+                    });
+                    spawn(writer(stream_write, messages_receive, pending));
+                    spawn(reader(ga.clone(), stream_read, notification_handler));
                     break Ok(ga);
                 }
                 Err(err) => match err.kind() {
@@ -481,73 +738,61 @@ impl GuestAgent {
         }
     }
 
-    fn get_new_msg_id(&mut self) -> u64 {
-        self.last_msg_id += 1;
-        self.last_msg_id
+    fn get_new_msg_id(&self) -> u64 {
+        self.last_msg_id.fetch_add(1, Ordering::Relaxed) + 1
     }
 
-    async fn get_response(&mut self, msg_id: u64) -> io::Result<Response> {
-        let ResponseWithId { id, resp } = match self.responses.next().await {
-            Some(x) => x,
-            None => {
-                return Err(self
-                    .responses_reader_handle
-                    .take()
-                    .unwrap()
-                    .await
-                    .unwrap_or_else(|join_error| {
-                        io::Error::new(
-                            io::ErrorKind::Other,
-                            format!("Unexpected error in reader task: {}", join_error),
-                        )
-                    }))
+    async fn get_response(&self, msg_id: u64, msg: Vec<u8>) -> io::Result<Response> {
+        let (send, recv) = oneshot::channel();
+        {
+            let mut pending = self.pending.lock().unwrap();
+            if let Some(err) = pending.error() {
+                return Err(err);
             }
-        };
+            pending.requests.insert(msg_id, send);
+        }
 
-        if id != msg_id {
+        if self.messages.unbounded_send(msg).is_err() {
+            self.pending.lock().unwrap().requests.remove(&msg_id);
             return Err(io::Error::new(
-                io::ErrorKind::InvalidData,
-                "Got response with different ID",
+                io::ErrorKind::BrokenPipe,
+                "Guest Agent writer task is gone",
             ));
         }
-        Ok(resp)
-    }
 
-    fn match_error<T>(resp: Response) -> io::Result<RemoteCommandResult<T>> {
-        match resp {
-            Response::Err(code) => Ok(Err(code)),
-            _ => Err(io::Error::new(
-                io::ErrorKind::InvalidData,
-                "Invalid response",
-            )),
-        }
+        // Dropped without a response only when the connection fails.
+        recv.await.map_err(|_| {
+            self.pending.lock().unwrap().error().unwrap_or_else(|| {
+                io::Error::new(io::ErrorKind::Other, "Guest Agent request dropped")
+            })
+        })
     }
 
-    async fn get_ok_response(&mut self, msg_id: u64) -> io::Result<RemoteCommandResult<()>> {
-        match self.get_response(msg_id).await? {
-            Response::Ok => Ok(Ok(())),
-            x => GuestAgent::match_error(x),
-        }
+    async fn get_ok_response(
+        &self,
+        msg_id: u64,
+        msg: Vec<u8>,
+    ) -> io::Result<RemoteCommandResult<()>> {
+        self.get_response(msg_id, msg).await?.into_ok()
     }
 
-    async fn get_u64_response(&mut self, msg_id: u64) -> io::Result<RemoteCommandResult<u64>> {
-        match self.get_response(msg_id).await? {
-            Response::OkU64(val) => Ok(Ok(val)),
-            x => GuestAgent::match_error(x),
-        }
+    async fn get_u64_response(
+        &self,
+        msg_id: u64,
+        msg: Vec<u8>,
+    ) -> io::Result<RemoteCommandResult<u64>> {
+        self.get_response(msg_id, msg).await?.into_u64()
     }
 
     async fn get_bytes_response(
-        &mut self,
+        &self,
         msg_id: u64,
+        msg: Vec<u8>,
     ) -> io::Result<RemoteCommandResult<Vec<u8>>> {
-        match self.get_response(msg_id).await? {
-            Response::OkBytes(bytes) => Ok(Ok(bytes)),
-            x => GuestAgent::match_error(x),
-        }
+        self.get_response(msg_id, msg).await?.into_bytes()
     }
 
-    pub async fn quit(&mut self) -> io::Result<RemoteCommandResult<()>> {
+    pub async fn quit(&self) -> io::Result<RemoteCommandResult<()>> {
         let mut msg = Message::default();
         let msg_id = self.get_new_msg_id();
 
@@ -555,14 +800,12 @@ impl GuestAgent {
 
         msg.append_submsg(&SubMsgQuitType::SubMsgEnd);
 
-        self.stream.write_all(msg.as_ref()).await?;
-
-        self.get_ok_response(msg_id).await
+        self.get_ok_response(msg_id, msg.into()).await
     }
 
     #[allow(clippy::too_many_arguments)]
     async fn spawn_new_process(
-        &mut self,
+        &self,
         bin: &str,
         argv: &[&str],
         maybe_env: Option<&[&str]>,
@@ -576,48 +819,24 @@ impl GuestAgent {
         let msg_id = self.get_new_msg_id();
 
         msg.create_header(msg_id);
-
-        msg.append_submsg(&SubMsgRunProcessType::SubMsgRunProcessBin(bin.as_bytes()));
-
-        msg.append_submsg(&SubMsgRunProcessType::SubMsgRunProcessArg(
-            &argv.iter().map(|s| s.as_bytes()).collect::<Vec<_>>(),
-        ));
-
-        if let Some(env) = maybe_env {
-            msg.append_submsg(&SubMsgRunProcessType::SubMsgRunProcessEnv(
-                &env.iter().map(|s| s.as_bytes()).collect::<Vec<_>>(),
-            ));
-        }
-
-        msg.append_submsg(&SubMsgRunProcessType::SubMsgRunProcessUid(uid));
-
-        msg.append_submsg(&SubMsgRunProcessType::SubMsgRunProcessGid(gid));
-
-        fds.iter()
-            .enumerate()
-            .filter_map(|(i, fdr)| fdr.as_ref().map(|fdr| (i, fdr)))
-            .for_each(|(i, fdr)| {
-                msg.append_submsg(&SubMsgRunProcessType::SubMsgRunProcessRfd(i as u32, fdr))
-            });
-
-        if let Some(cwd) = maybe_cwd {
-            msg.append_submsg(&SubMsgRunProcessType::SubMsgRunProcessCwd(cwd.as_bytes()));
-        }
-
-        if is_entrypoint {
-            msg.append_submsg(&SubMsgRunProcessType::SubMsgRunProcessEnt);
-        }
-
-        msg.append_submsg(&SubMsgRunProcessType::SubMsgEnd);
-
-        self.stream.write_all(msg.as_ref()).await?;
-
-        self.get_u64_response(msg_id).await
+        encode_run_process(
+            &mut msg,
+            bin,
+            argv,
+            maybe_env,
+            uid,
+            gid,
+            fds,
+            maybe_cwd,
+            is_entrypoint,
+        );
+
+        self.get_u64_response(msg_id, msg.into()).await
     }
 
     #[allow(clippy::too_many_arguments)]
     pub async fn run_process(
-        &mut self,
+        &self,
         bin: &str,
         argv: &[&str],
         maybe_env: Option<&[&str]>,
@@ -634,7 +853,7 @@ impl GuestAgent {
 
     #[allow(clippy::too_many_arguments)]
     pub async fn run_entrypoint(
-        &mut self,
+        &self,
         bin: &str,
         argv: &[&str],
         maybe_env: Option<&[&str]>,
@@ -649,41 +868,27 @@ impl GuestAgent {
         .await
     }
 
-    pub async fn kill(&mut self, id: u64) -> io::Result<RemoteCommandResult<()>> {
+    pub async fn kill(&self, id: u64) -> io::Result<RemoteCommandResult<()>> {
         let mut msg = Message::default();
         let msg_id = self.get_new_msg_id();
 
         msg.create_header(msg_id);
+        encode_kill(&mut msg, id);
 
-        msg.append_submsg(&SubMsgKillProcessType::SubMsgKillProcessId(id));
-
-        msg.append_submsg(&SubMsgKillProcessType::SubMsgEnd);
-
-        self.stream.write_all(msg.as_ref()).await?;
-
-        self.get_ok_response(msg_id).await
+        self.get_ok_response(msg_id, msg.into()).await
     }
 
-    pub async fn mount(&mut self, tag: &str, path: &str) -> io::Result<RemoteCommandResult<()>> {
+    pub async fn mount(&self, tag: &str, path: &str) -> io::Result<RemoteCommandResult<()>> {
         let mut msg = Message::default();
         let msg_id = self.get_new_msg_id();
 
         msg.create_header(msg_id);
+        encode_mount(&mut msg, tag, path);
 
-        msg.append_submsg(&SubMsgMountVolumeType::SubMsgMountVolumeTag(tag.as_bytes()));
-
-        msg.append_submsg(&SubMsgMountVolumeType::SubMsgMountVolumePath(
-            path.as_bytes(),
-        ));
-
-        msg.append_submsg(&SubMsgMountVolumeType::SubMsgEnd);
-
-        self.stream.write_all(msg.as_ref()).await?;
-
-        self.get_ok_response(msg_id).await
+        self.get_ok_response(msg_id, msg.into()).await
     }
 
-    pub async fn add_hosts<'a, I, T, S>(&mut self, hosts: I) -> io::Result<RemoteCommandResult<()>>
+    pub async fn add_hosts<'a, I, T, S>(&self, hosts: I) -> io::Result<RemoteCommandResult<()>>
     where
         I: Iterator<Item = (T, S)>,
         T: AsRef<str>,
@@ -693,20 +898,13 @@ impl GuestAgent {
         let msg_id = self.get_new_msg_id();
 
         msg.create_header(msg_id);
-        for (hostname, ip) in hosts {
-            msg.append_submsg(&SubMsgNetHostType::SubMsgNetHostEntry(
-                ip.as_ref().as_bytes(),
-                hostname.as_ref().as_bytes(),
-            ));
-        }
-        msg.append_submsg(&SubMsgNetHostType::SubMsgEnd);
+        encode_add_hosts(&mut msg, hosts);
 
-        self.stream.write_all(msg.as_ref()).await?;
-        self.get_ok_response(msg_id).await
+        self.get_ok_response(msg_id, msg.into()).await
     }
 
     pub async fn create_network(
-        &mut self,
+        &self,
         addr: &str,
         mask: &str,
         gateway: &str,
@@ -714,43 +912,48 @@ impl GuestAgent {
     ) -> io::Result<RemoteCommandResult<()>> {
         let mut msg = Message::default();
         let msg_id = self.get_new_msg_id();
-        let flags = SubMsgNetCtlFlags::Add as u16;
 
         msg.create_header(msg_id);
-        msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlFlags(flags));
-        msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlAddr(addr.as_bytes()));
-        msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlMask(mask.as_bytes()));
-        msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlGateway(gateway.as_bytes()));
-        msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlIf(iface));
-        msg.append_submsg(&SubMsgNetCtlType::SubMsgEnd);
+        encode_create_network(&mut msg, addr, mask, gateway, iface);
 
-        self.stream.write_all(msg.as_ref()).await?;
-        self.get_ok_response(msg_id).await
+        self.get_ok_response(msg_id, msg.into()).await
     }
 
     pub async fn add_address(
-        &mut self,
+        &self,
         if_addr: &str,
         mask: &str,
         iface: u16,
     ) -> io::Result<RemoteCommandResult<()>> {
         let mut msg = Message::default();
         let msg_id = self.get_new_msg_id();
-        let flags = SubMsgNetCtlFlags::Add as u16;
 
         msg.create_header(msg_id);
-        msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlFlags(flags));
-        msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlIfAddr(if_addr.as_bytes()));
-        msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlMask(mask.as_bytes()));
-        msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlIf(iface));
-        msg.append_submsg(&SubMsgNetCtlType::SubMsgEnd);
+        encode_add_address(&mut msg, if_addr, mask, iface);
 
-        self.stream.write_all(msg.as_ref()).await?;
-        self.get_ok_response(msg_id).await
+        self.get_ok_response(msg_id, msg.into()).await
+    }
+
+    /// Limits the rate of traffic forwarded by the guest in each direction of
+    /// an interface. A zero rate is not limited.
+    pub async fn set_rate(
+        &self,
+        bytes_per_sec: u64,
+        frames_per_sec: u64,
+        burst_us: u32,
+        iface: u16,
+    ) -> io::Result<RemoteCommandResult<()>> {
+        let mut msg = Message::default();
+        let msg_id = self.get_new_msg_id();
+
+        msg.create_header(msg_id);
+        encode_set_rate(&mut msg, bytes_per_sec, frames_per_sec, burst_us, iface);
+
+        self.get_ok_response(msg_id, msg.into()).await
     }
 
     pub async fn query_output(
-        &mut self,
+        &self,
         id: u64,
         fd: u8,
         off: u64,
@@ -760,16 +963,331 @@ impl GuestAgent {
         let msg_id = self.get_new_msg_id();
 
         msg.create_header(msg_id);
+        encode_query_output(&mut msg, id, fd, off, len);
+
+        self.get_bytes_response(msg_id, msg.into()).await
+    }
+
+    /// Lets the guest push `bytes` more of the output streamed from a
+    /// `RedirectFdPipeStream` redirect. The bytes are given back to the credit
+    /// shared by all streams as well, so this is meant to be called once the
+    /// data of a `Notification::OutputData` is consumed.
+    pub async fn output_credit(
+        &self,
+        id: u64,
+        fd: u8,
+        bytes: u64,
+    ) -> io::Result<RemoteCommandResult<()>> {
+        let mut msg = Message::default();
+        let msg_id = self.get_new_msg_id();
+
+        msg.create_header(msg_id);
+        encode_output_credit(&mut msg, id, fd, bytes);
+
+        self.get_ok_response(msg_id, msg.into()).await
+    }
+
+    pub async fn net_stats(&self) -> io::Result<RemoteCommandResult<Vec<NetStats>>> {
+        let mut msg = Message::default();
+        let msg_id = self.get_new_msg_id();
+
+        msg.create_header(msg_id);
+        msg.append_submsg(&SubMsgNetStatsType::SubMsgEnd);
+
+        match self.get_bytes_response(msg_id, msg.into()).await? {
+            Ok(bytes) => Ok(Ok(NetStats::parse_all(&bytes)?)),
+            Err(code) => Ok(Err(code)),
+        }
+    }
+
+    /// Sends all operations of the batch in a single message. The guest
+    /// executes them in order; the result has a response for each of them.
+    pub async fn batch(&self, batch: Batch) -> io::Result<RemoteCommandResult<Vec<Response>>> {
+        let mut msg = Message::default();
+        let msg_id = self.get_new_msg_id();
+
+        msg.create_header(msg_id);
+        msg.buf.extend(batch.buf);
+        msg.append_submsg(&SubMsgBatchType::SubMsgEnd);
+
+        match self.get_response(msg_id, msg.into()).await? {
+            Response::Batch(responses) if responses.len() == batch.len => Ok(Ok(responses)),
+            Response::Batch(_) => Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "Invalid number of batch responses",
+            )),
+            x => x.into_error(),
+        }
+    }
+}
+
+/// Operations executed by the guest one after another, sent in a single
+/// message with `GuestAgent::batch`.
+#[derive(Default)]
+pub struct Batch {
+    buf: Vec<u8>,
+    len: usize,
+}
+
+impl Batch {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Number of operations in the batch.
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    fn push<T: SubMsgTrait<T>>(&mut self, item: Message<T>) -> &mut Self {
+        SubMsgBatchType::SubMsgBatchItem(T::TYPE, &item.buf).encode_into(&mut self.buf);
+        self.len += 1;
+        self
+    }
+
+    /// Responds with `Response::OkU64` holding the process ID.
+    #[allow(clippy::too_many_arguments)]
+    pub fn run_process(
+        &mut self,
+        bin: &str,
+        argv: &[&str],
+        maybe_env: Option<&[&str]>,
+        uid: u32,
+        gid: u32,
+        fds: &[Option<RedirectFdType<'_>>; 3],
+        maybe_cwd: Option<&str>,
+    ) -> &mut Self {
+        let mut msg = Message::default();
+        encode_run_process(
+            &mut msg, bin, argv, maybe_env, uid, gid, fds, maybe_cwd, false,
+        );
+        self.push(msg)
+    }
+
+    /// Responds with `Response::Ok`.
+    pub fn kill(&mut self, id: u64) -> &mut Self {
+        let mut msg = Message::default();
+        encode_kill(&mut msg, id);
+        self.push(msg)
+    }
+
+    /// Responds with `Response::Ok`.
+    pub fn mount(&mut self, tag: &str, path: &str) -> &mut Self {
+        let mut msg = Message::default();
+        encode_mount(&mut msg, tag, path);
+        self.push(msg)
+    }
+
+    /// Responds with `Response::Ok`.
+    pub fn add_hosts<I, T, S>(&mut self, hosts: I) -> &mut Self
+    where
+        I: Iterator<Item = (T, S)>,
+        T: AsRef<str>,
+        S: AsRef<str>,
+    {
+        let mut msg = Message::default();
+        encode_add_hosts(&mut msg, hosts);
+        self.push(msg)
+    }
 
-        msg.append_submsg(&SubMsgQueryOutputType::SubMsgQueryOutputId(id));
-        msg.append_submsg(&SubMsgQueryOutputType::SubMsgQueryOutputFd(fd));
-        msg.append_submsg(&SubMsgQueryOutputType::SubMsgQueryOutputOff(off));
-        msg.append_submsg(&SubMsgQueryOutputType::SubMsgQueryOutputLen(len));
+    /// Responds with `Response::Ok`.
+    pub fn create_network(
+        &mut self,
+        addr: &str,
+        mask: &str,
+        gateway: &str,
+        iface: u16,
+    ) -> &mut Self {
+        let mut msg = Message::default();
+        encode_create_network(&mut msg, addr, mask, gateway, iface);
+        self.push(msg)
+    }
 
-        msg.append_submsg(&SubMsgQueryOutputType::SubMsgEnd);
+    /// Responds with `Response::Ok`.
+    pub fn add_address(&mut self, if_addr: &str, mask: &str, iface: u16) -> &mut Self {
+        let mut msg = Message::default();
+        encode_add_address(&mut msg, if_addr, mask, iface);
+        self.push(msg)
+    }
 
-        self.stream.write_all(msg.as_ref()).await?;
+    /// Responds with `Response::Ok`.
+    pub fn set_rate(
+        &mut self,
+        bytes_per_sec: u64,
+        frames_per_sec: u64,
+        burst_us: u32,
+        iface: u16,
+    ) -> &mut Self {
+        let mut msg = Message::default();
+        encode_set_rate(&mut msg, bytes_per_sec, frames_per_sec, burst_us, iface);
+        self.push(msg)
+    }
 
-        self.get_bytes_response(msg_id).await
+    /// Responds with `Response::OkBytes` holding the output.
+    pub fn query_output(&mut self, id: u64, fd: u8, off: u64, len: u64) -> &mut Self {
+        let mut msg = Message::default();
+        encode_query_output(&mut msg, id, fd, off, len);
+        self.push(msg)
     }
+
+    /// Responds with `Response::Ok`.
+    pub fn output_credit(&mut self, id: u64, fd: u8, bytes: u64) -> &mut Self {
+        let mut msg = Message::default();
+        encode_output_credit(&mut msg, id, fd, bytes);
+        self.push(msg)
+    }
+}
+
+#[allow(clippy::too_many_arguments)]
+fn encode_run_process(
+    msg: &mut Message<SubMsgRunProcessType<'_>>,
+    bin: &str,
+    argv: &[&str],
+    maybe_env: Option<&[&str]>,
+    uid: u32,
+    gid: u32,
+    fds: &[Option<RedirectFdType<'_>>; 3],
+    maybe_cwd: Option<&str>,
+    is_entrypoint: bool,
+) {
+    msg.append_submsg(&SubMsgRunProcessType::SubMsgRunProcessBin(bin.as_bytes()));
+
+    msg.append_submsg(&SubMsgRunProcessType::SubMsgRunProcessArg(
+        &argv.iter().map(|s| s.as_bytes()).collect::<Vec<_>>(),
+    ));
+
+    if let Some(env) = maybe_env {
+        msg.append_submsg(&SubMsgRunProcessType::SubMsgRunProcessEnv(
+            &env.iter().map(|s| s.as_bytes()).collect::<Vec<_>>(),
+        ));
+    }
+
+    msg.append_submsg(&SubMsgRunProcessType::SubMsgRunProcessUid(uid));
+
+    msg.append_submsg(&SubMsgRunProcessType::SubMsgRunProcessGid(gid));
+
+    fds.iter()
+        .enumerate()
+        .filter_map(|(i, fdr)| fdr.as_ref().map(|fdr| (i, fdr)))
+        .for_each(|(i, fdr)| {
+            msg.append_submsg(&SubMsgRunProcessType::SubMsgRunProcessRfd(i as u32, fdr))
+        });
+
+    if let Some(cwd) = maybe_cwd {
+        msg.append_submsg(&SubMsgRunProcessType::SubMsgRunProcessCwd(cwd.as_bytes()));
+    }
+
+    if is_entrypoint {
+        msg.append_submsg(&SubMsgRunProcessType::SubMsgRunProcessEnt);
+    }
+
+    msg.append_submsg(&SubMsgRunProcessType::SubMsgEnd);
+}
+
+fn encode_kill(msg: &mut Message<SubMsgKillProcessType>, id: u64) {
+    msg.append_submsg(&SubMsgKillProcessType::SubMsgKillProcessId(id));
+
+    msg.append_submsg(&SubMsgKillProcessType::SubMsgEnd);
+}
+
+fn encode_mount(msg: &mut Message<SubMsgMountVolumeType<'_>>, tag: &str, path: &str) {
+    msg.append_submsg(&SubMsgMountVolumeType::SubMsgMountVolumeTag(tag.as_bytes()));
+
+    msg.append_submsg(&SubMsgMountVolumeType::SubMsgMountVolumePath(
+        path.as_bytes(),
+    ));
+
+    msg.append_submsg(&SubMsgMountVolumeType::SubMsgEnd);
+}
+
+fn encode_add_hosts<I, T, S>(msg: &mut Message<SubMsgNetHostType<'_>>, hosts: I)
+where
+    I: Iterator<Item = (T, S)>,
+    T: AsRef<str>,
+    S: AsRef<str>,
+{
+    for (hostname, ip) in hosts {
+        msg.append_submsg(&SubMsgNetHostType::SubMsgNetHostEntry(
+            ip.as_ref().as_bytes(),
+            hostname.as_ref().as_bytes(),
+        ));
+    }
+    msg.append_submsg(&SubMsgNetHostType::SubMsgEnd);
+}
+
+fn encode_create_network(
+    msg: &mut Message<SubMsgNetCtlType<'_>>,
+    addr: &str,
+    mask: &str,
+    gateway: &str,
+    iface: u16,
+) {
+    let flags = SubMsgNetCtlFlags::Add as u16;
+
+    msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlFlags(flags));
+    msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlAddr(addr.as_bytes()));
+    msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlMask(mask.as_bytes()));
+    msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlGateway(gateway.as_bytes()));
+    msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlIf(iface));
+    msg.append_submsg(&SubMsgNetCtlType::SubMsgEnd);
+}
+
+fn encode_add_address(
+    msg: &mut Message<SubMsgNetCtlType<'_>>,
+    if_addr: &str,
+    mask: &str,
+    iface: u16,
+) {
+    let flags = SubMsgNetCtlFlags::Add as u16;
+
+    msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlFlags(flags));
+    msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlIfAddr(if_addr.as_bytes()));
+    msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlMask(mask.as_bytes()));
+    msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlIf(iface));
+    msg.append_submsg(&SubMsgNetCtlType::SubMsgEnd);
+}
+
+fn encode_set_rate(
+    msg: &mut Message<SubMsgNetCtlType<'_>>,
+    bytes_per_sec: u64,
+    frames_per_sec: u64,
+    burst_us: u32,
+    iface: u16,
+) {
+    let flags = SubMsgNetCtlFlags::Empty as u16;
+
+    msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlFlags(flags));
+    msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlRateBps(bytes_per_sec));
+    msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlRatePps(frames_per_sec));
+    msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlRateBurst(burst_us));
+    msg.append_submsg(&SubMsgNetCtlType::SubMsgNetCtlIf(iface));
+    msg.append_submsg(&SubMsgNetCtlType::SubMsgEnd);
+}
+
+fn encode_query_output(
+    msg: &mut Message<SubMsgQueryOutputType>,
+    id: u64,
+    fd: u8,
+    off: u64,
+    len: u64,
+) {
+    msg.append_submsg(&SubMsgQueryOutputType::SubMsgQueryOutputId(id));
+    msg.append_submsg(&SubMsgQueryOutputType::SubMsgQueryOutputFd(fd));
+    msg.append_submsg(&SubMsgQueryOutputType::SubMsgQueryOutputOff(off));
+    msg.append_submsg(&SubMsgQueryOutputType::SubMsgQueryOutputLen(len));
+
+    msg.append_submsg(&SubMsgQueryOutputType::SubMsgEnd);
+}
+
+fn encode_output_credit(msg: &mut Message<SubMsgOutputCreditType>, id: u64, fd: u8, bytes: u64) {
+    msg.append_submsg(&SubMsgOutputCreditType::SubMsgOutputCreditId(id));
+    msg.append_submsg(&SubMsgOutputCreditType::SubMsgOutputCreditFd(fd));
+    msg.append_submsg(&SubMsgOutputCreditType::SubMsgOutputCreditBytes(bytes));
+    msg.append_submsg(&SubMsgOutputCreditType::SubMsgOutputCreditChannel(bytes));
+
+    msg.append_submsg(&SubMsgOutputCreditType::SubMsgEnd);
 }
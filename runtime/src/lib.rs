@@ -23,7 +23,7 @@ use url::Url;
 use crate::{
     cpu::CpuInfo,
     deploy::Deployment,
-    guest_agent_comm::{RedirectFdType, RemoteCommandResult},
+    guest_agent_comm::{Batch, RedirectFdType, RemoteCommandResult},
     vmrt::{start_vmrt, RuntimeData},
 };
 use ya_runtime_sdk::runtime_api::deploy::ContainerEndpoint;
@@ -39,6 +39,9 @@ use ya_runtime_sdk::{
 
 const FILE_DEPLOYMENT: &str = "deployment.json";
 const DEFAULT_CWD: &str = "/";
+/// Upper bound of a process output buffer; the guest grows it on demand, the
+/// multi-MiB sizes it reaches under heavy output are backed by huge pages.
+const OUTPUT_BUFFER_MAX: u64 = 0x800000;
 
 #[derive(StructOpt, Clone, Default)]
 #[structopt(rename_all = "kebab-case")]
@@ -71,6 +74,28 @@ pub struct Cli {
     #[structopt(long, env = "PCI_DEVICE")]
     /// PCI device identifier
     pci_device: Option<String>,
+    /// Number of network forwarding threads in the guest
+    #[structopt(long, env = "FWD_THREADS")]
+    fwd_threads: Option<usize>,
+    /// Network forwarding mode in the guest
+    #[structopt(long, env = "FWD_MODE", possible_values = &["blocking", "sqpoll", "adaptive"])]
+    fwd_mode: Option<String>,
+    /// Busy-polling window of the network forwarder in the guest [us]
+    #[structopt(long, env = "FWD_BUSY_POLL_US")]
+    fwd_busy_poll_us: Option<u32>,
+    /// Splice outgoing frames in the guest instead of copying them
+    #[structopt(long)]
+    fwd_splice: bool,
+    /// Forward frames with a virtio-net header and a 32-bit length prefix
+    #[structopt(long)]
+    fwd_vnet_hdr: bool,
+    /// Use a multi-queue tap with a forwarding thread per vCPU in the guest
+    #[structopt(long)]
+    fwd_multi_queue: bool,
+    /// Stream process output with flow control, stalling processes the host
+    /// cannot keep up with instead of overwriting their oldest output
+    #[structopt(long)]
+    stream_output: bool,
 }
 
 #[derive(ya_runtime_sdk::RuntimeDef, Default)]
@@ -105,6 +130,13 @@ impl ya_runtime_sdk::Runtime for Runtime {
         let vpn_endpoint = ctx.cli.runtime.vpn_endpoint.clone();
         let inet_endpoint = ctx.cli.runtime.inet_endpoint.clone();
         let pci_device_id = ctx.cli.runtime.pci_device.clone();
+        let fwd_threads = ctx.cli.runtime.fwd_threads;
+        let fwd_mode = ctx.cli.runtime.fwd_mode.clone();
+        let fwd_busy_poll_us = ctx.cli.runtime.fwd_busy_poll_us;
+        let fwd_splice = ctx.cli.runtime.fwd_splice;
+        let fwd_vnet_hdr = ctx.cli.runtime.fwd_vnet_hdr;
+        let fwd_multi_queue = ctx.cli.runtime.fwd_multi_queue;
+        let stream_output = ctx.cli.runtime.stream_output;
 
         log::info!("VPN endpoint: {vpn_endpoint:?}");
         log::info!("INET endpoint: {inet_endpoint:?}");
@@ -130,6 +162,13 @@ impl ya_runtime_sdk::Runtime for Runtime {
                 if let Some(pci_device_id) = pci_device_id {
                     data.pci_device_id.replace(pci_device_id);
                 }
+                data.fwd_threads = fwd_threads;
+                data.fwd_mode = fwd_mode;
+                data.fwd_busy_poll_us = fwd_busy_poll_us;
+                data.fwd_splice = fwd_splice;
+                data.fwd_vnet_hdr = fwd_vnet_hdr;
+                data.fwd_multi_queue = fwd_multi_queue;
+                data.stream_output = stream_output;
                 if let Some(vpn_endpoint) = vpn_endpoint {
                     let endpoint =
                         ContainerEndpoint::try_from(vpn_endpoint).map_err(Error::from)?;
@@ -270,27 +309,40 @@ pub(crate) async fn run_command(
     runtime_data: Arc<Mutex<RuntimeData>>,
     run: server::RunProcess,
 ) -> Result<ProcessId, server::ErrorResponse> {
-    let data = runtime_data.lock().await;
-    let deployment = data.deployment().expect("Runtime not started");
-
-    let (uid, gid) = deployment.user;
-    let env = deployment.env();
-    let cwd = deployment
-        .config
-        .working_dir
-        .as_ref()
-        .filter(|s| !s.trim().is_empty())
-        .map(|s| s.as_str())
-        .unwrap_or_else(|| DEFAULT_CWD);
-
-    log::debug!("got run process: {:?}", run);
-    log::debug!("work dir: {:?}", deployment.config.working_dir);
-
-    let result = data
-        .ga()
-        .unwrap()
-        .lock()
-        .await
+    let (ga, env, cwd, (uid, gid), stream_output): (_, Vec<String>, _, _, _) = {
+        let data = runtime_data.lock().await;
+        let deployment = data.deployment().expect("Runtime not started");
+        let cwd = deployment
+            .config
+            .working_dir
+            .as_ref()
+            .filter(|s| !s.trim().is_empty())
+            .cloned()
+            .unwrap_or_else(|| DEFAULT_CWD.to_string());
+
+        log::debug!("got run process: {:?}", run);
+        log::debug!("work dir: {:?}", deployment.config.working_dir);
+
+        // Do not hold the lock, so that other commands can be sent meanwhile.
+        let env = deployment.env().into_iter().map(String::from).collect();
+        (
+            data.ga().unwrap(),
+            env,
+            cwd,
+            deployment.user,
+            data.stream_output,
+        )
+    };
+    // Unless asked to stream, a slow host must not stall the process.
+    let output = || {
+        if stream_output {
+            RedirectFdType::RedirectFdPipeStream(OUTPUT_BUFFER_MAX)
+        } else {
+            RedirectFdType::RedirectFdPipeCyclic(OUTPUT_BUFFER_MAX)
+        }
+    };
+
+    let result = ga
         .run_process(
             &run.bin,
             run.args
@@ -298,15 +350,11 @@ pub(crate) async fn run_command(
                 .map(|s| s.as_ref())
                 .collect::<Vec<&str>>()
                 .as_slice(),
-            Some(&env[..]),
+            Some(&env.iter().map(|s| s.as_str()).collect::<Vec<_>>()),
             uid,
             gid,
-            &[
-                None,
-                Some(RedirectFdType::RedirectFdPipeCyclic(0x1000)),
-                Some(RedirectFdType::RedirectFdPipeCyclic(0x1000)),
-            ],
-            Some(cwd),
+            &[None, Some(output()), Some(output())],
+            Some(&cwd),
         )
         .await;
 
@@ -319,9 +367,8 @@ async fn kill_command(
 ) -> Result<(), server::ErrorResponse> {
     log::debug!("got kill: {:?}", kill);
     // TODO: send signal
-    let data = runtime_data.lock().await;
-    let mutex = data.ga().unwrap();
-    let result = mutex.lock().await.kill(kill.pid).await;
+    let ga = runtime_data.lock().await.ga().unwrap();
+    let result = ga.kill(kill.pid).await;
     convert_result(result, &format!("Killing process {}", kill.pid))?;
     Ok(())
 }
@@ -333,11 +380,7 @@ pub(crate) async fn stop(
     let mut data = runtime_data.lock().await;
     let mut runtime = data.runtime().unwrap();
 
-    {
-        let mutex = data.ga().unwrap();
-        let mut ga = mutex.lock().await;
-        convert_result(ga.quit().await, "Sending quit")?;
-    }
+    convert_result(data.ga().unwrap().quit().await, "Sending quit")?;
 
     runtime
         .wait()
@@ -403,9 +446,10 @@ async fn join_network(
     .cloned()
     .expect("No network endpoint");
 
-    let mutex = data.ga().unwrap();
-    let mut ga = mutex.lock().await;
-    convert_result(ga.add_hosts(hosts.iter()).await, "Updating network hosts")?;
+    // Hosts and all of the networks are set up in a single round trip.
+    let mut batch = Batch::new();
+    let mut contexts = vec!["Updating network hosts".to_string()];
+    batch.add_hosts(hosts.iter());
 
     for net in networks {
         let (net_addr, net_mask) = match iface {
@@ -413,18 +457,22 @@ async fn join_network(
             server::NetworkInterface::Inet => Default::default(),
         };
 
-        convert_result(
-            ga.add_address(&net.if_addr, &net.mask, iface as u16).await,
-            &format!("Adding interface address {} {}", net.if_addr, net.gateway),
-        )?;
-        convert_result(
-            ga.create_network(&net_addr, &net_mask, &net.gateway, iface as u16)
-                .await,
-            &format!(
-                "Creating route via {} for {} ({:?})",
-                net.gateway, net_addr, iface
-            ),
-        )?;
+        batch.add_address(&net.if_addr, &net.mask, iface as u16);
+        contexts.push(format!(
+            "Adding interface address {} {}",
+            net.if_addr, net.gateway
+        ));
+        batch.create_network(&net_addr, &net_mask, &net.gateway, iface as u16);
+        contexts.push(format!(
+            "Creating route via {} for {} ({:?})",
+            net.gateway, net_addr, iface
+        ));
+    }
+
+    let ga = data.ga().unwrap();
+    let responses = convert_result(ga.batch(batch).await, "Joining network")?;
+    for (response, context) in responses.into_iter().zip(contexts) {
+        convert_result(response.into_ok(), &context)?;
     }
 
     Ok(endpoint)
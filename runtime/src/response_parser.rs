@@ -8,6 +8,8 @@ pub enum Response {
     OkU64(u64),
     OkBytes(Vec<u8>),
     Err(u32),
+    /// Responses to the items of a batch, in order.
+    Batch(Vec<Response>),
 }
 
 #[derive(Debug)]
@@ -43,6 +45,8 @@ pub struct ExitReason {
 pub enum Notification {
     OutputAvailable { id: u64, fd: u32 },
     ProcessDied { id: u64, reason: ExitReason },
+    OutputDropped { id: u64, fd: u32, dropped: u64 },
+    OutputData { id: u64, fd: u32, data: Vec<u8> },
 }
 
 #[derive(Debug)]
@@ -82,6 +86,20 @@ async fn recv_bytes<T: AsyncRead + Unpin>(stream: &mut T) -> io::Result<Vec<u8>>
     Ok(buf)
 }
 
+/// Parses the body of a response other than a batch one.
+async fn recv_response<T: AsyncRead + Unpin>(stream: &mut T, typ: u8) -> io::Result<Response> {
+    match typ {
+        0 => Ok(Response::Ok),
+        1 => Ok(Response::OkU64(recv_u64(stream).await?)),
+        2 => Ok(Response::OkBytes(recv_bytes(stream).await?)),
+        3 => Ok(Response::Err(recv_u32(stream).await?)),
+        _ => Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            "Invalid response type",
+        )),
+    }
+}
+
 pub async fn parse_one_response<T: AsyncRead + Unpin>(
     stream: &mut T,
 ) -> io::Result<GuestAgentMessage> {
@@ -89,30 +107,9 @@ pub async fn parse_one_response<T: AsyncRead + Unpin>(
 
     let typ = recv_u8(stream).await?;
     match typ {
-        0 => Ok(GuestAgentMessage::Response(ResponseWithId {
-            id,
-            resp: Response::Ok,
-        })),
-        1 => {
-            let val = recv_u64(stream).await?;
-            Ok(GuestAgentMessage::Response(ResponseWithId {
-                id,
-                resp: Response::OkU64(val),
-            }))
-        }
-        2 => {
-            let buf = recv_bytes(stream).await?;
-            Ok(GuestAgentMessage::Response(ResponseWithId {
-                id,
-                resp: Response::OkBytes(buf),
-            }))
-        }
-        3 => {
-            let code = recv_u32(stream).await?;
-            Ok(GuestAgentMessage::Response(ResponseWithId {
-                id,
-                resp: Response::Err(code),
-            }))
+        0..=3 => {
+            let resp = recv_response(stream, typ).await?;
+            Ok(GuestAgentMessage::Response(ResponseWithId { id, resp }))
         }
         4 => {
             if id == 0 {
@@ -144,6 +141,54 @@ pub async fn parse_one_response<T: AsyncRead + Unpin>(
                 ))
             }
         }
+        6 => {
+            if id == 0 {
+                let proc_id = recv_u64(stream).await?;
+                let fd = recv_u32(stream).await?;
+                let dropped = recv_u64(stream).await?;
+                Ok(GuestAgentMessage::Notification(
+                    Notification::OutputDropped {
+                        id: proc_id,
+                        fd,
+                        dropped,
+                    },
+                ))
+            } else {
+                Err(io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    "Invalid response message ID",
+                ))
+            }
+        }
+        7 => {
+            let count = recv_u64(stream).await?;
+            let mut responses = Vec::new();
+            for _ in 0..count {
+                let typ = recv_u8(stream).await?;
+                responses.push(recv_response(stream, typ).await?);
+            }
+            Ok(GuestAgentMessage::Response(ResponseWithId {
+                id,
+                resp: Response::Batch(responses),
+            }))
+        }
+        8 => {
+            if id == 0 {
+                let proc_id = recv_u64(stream).await?;
+                let fd = recv_u32(stream).await?;
+                let data = recv_bytes(stream).await?;
+                Ok(GuestAgentMessage::Notification(Notification::OutputData {
+                    id: proc_id,
+                    fd,
+                    data,
+                }))
+            } else {
+                Err(io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    "Invalid response message ID",
+                ))
+            }
+        }
         _ => Err(io::Error::new(
             io::ErrorKind::InvalidData,
             "Invalid response type",
@@ -1,3 +1,4 @@
+use std::collections::HashMap;
 use std::net::{Ipv4Addr, SocketAddrV4};
 use std::path::{Path, PathBuf};
 use std::process::Stdio;
@@ -15,7 +16,7 @@ use ya_runtime_sdk::server::ContainerEndpoint;
 use ya_runtime_sdk::{serialize, ErrorExt, EventEmitter};
 
 use crate::deploy::Deployment;
-use crate::guest_agent_comm::{GuestAgent, Notification};
+use crate::guest_agent_comm::{Batch, GuestAgent, Notification, Response};
 
 const DIR_RUNTIME: &str = "runtime";
 const FILE_RUNTIME: &str = "vmrt";
@@ -28,8 +29,15 @@ pub struct RuntimeData {
     pub vpn: Option<ContainerEndpoint>,
     pub inet: Option<ContainerEndpoint>,
     pub deployment: Option<Deployment>,
-    pub ga: Option<Arc<Mutex<GuestAgent>>>,
+    pub ga: Option<Arc<GuestAgent>>,
     pub pci_device_id: Option<String>,
+    pub fwd_threads: Option<usize>,
+    pub fwd_mode: Option<String>,
+    pub fwd_busy_poll_us: Option<u32>,
+    pub fwd_splice: bool,
+    pub fwd_vnet_hdr: bool,
+    pub fwd_multi_queue: bool,
+    pub stream_output: bool,
 }
 
 impl RuntimeData {
@@ -45,11 +53,35 @@ impl RuntimeData {
             .ok_or_else(|| anyhow::anyhow!("Runtime not deployed"))
     }
 
-    pub fn ga(&self) -> anyhow::Result<Arc<Mutex<GuestAgent>>> {
+    pub fn ga(&self) -> anyhow::Result<Arc<GuestAgent>> {
         self.ga
             .clone()
             .ok_or_else(|| anyhow::anyhow!("Runtime not started"))
     }
+
+    /// Guest kernel command line, including parameters read by init.
+    pub fn kernel_cmdline(&self) -> String {
+        let mut cmdline = String::from("console=ttyS0 panic=1");
+        if let Some(threads) = self.fwd_threads {
+            cmdline.push_str(&format!(" ya.fwd_threads={}", threads));
+        }
+        if let Some(mode) = &self.fwd_mode {
+            cmdline.push_str(&format!(" ya.fwd_mode={}", mode));
+        }
+        if let Some(busy_poll_us) = self.fwd_busy_poll_us {
+            cmdline.push_str(&format!(" ya.fwd_busy_poll_us={}", busy_poll_us));
+        }
+        if self.fwd_splice {
+            cmdline.push_str(" ya.fwd_splice=1");
+        }
+        if self.fwd_vnet_hdr {
+            cmdline.push_str(" ya.fwd_vnet_hdr=1");
+        }
+        if self.fwd_multi_queue {
+            cmdline.push_str(" ya.fwd_multi_queue=1");
+        }
+        cmdline
+    }
 }
 
 pub async fn start_vmrt(
@@ -85,7 +117,7 @@ pub async fn start_vmrt(
         "-smp",
         deployment.cpu_cores.to_string().as_str(),
         "-append",
-        "console=ttyS0 panic=1",
+        data.kernel_cmdline().as_str(),
         "-device",
         "virtio-serial",
         "-device",
@@ -156,22 +188,34 @@ pub async fn start_vmrt(
     let stdout = runtime.stdout.take().unwrap();
     spawn(reader_to_log(stdout));
 
+    let credit = Arc::new(std::sync::Mutex::new(OutputCredit::default()));
     let ga = GuestAgent::connected(manager_sock, 10, move |notification, ga| {
         let mut emitter = emitter.clone();
+        let credit = credit.clone();
         async move {
-            let status = notification_into_status(notification, ga).await;
-            emitter.emit(status).await;
+            let streamed = match &notification {
+                Notification::OutputData { id, fd, data } => Some((*id, *fd, data.len() as u64)),
+                _ => None,
+            };
+            if let Some(status) = notification_into_status(notification, ga.clone()).await {
+                emitter.emit(status).await;
+            }
+            // Streamed output is credited back only once it has been passed on.
+            if let Some((id, fd, len)) = streamed {
+                credit_output(&credit, ga, id, fd, len);
+            }
         }
         .boxed()
     })
     .await?;
 
-    {
-        let mut ga = ga.lock().await;
-        for (idx, volume) in deployment.volumes.iter().enumerate() {
-            ga.mount(format!("mnt{}", idx).as_str(), volume.path.as_str())
-                .await?
-                .expect("Mount failed");
+    let mut mounts = Batch::new();
+    for (idx, volume) in deployment.volumes.iter().enumerate() {
+        mounts.mount(format!("mnt{}", idx).as_str(), volume.path.as_str());
+    }
+    if !mounts.is_empty() {
+        for response in ga.batch(mounts).await?.expect("Mount failed") {
+            response.into_ok()?.expect("Mount failed");
         }
     }
 
@@ -341,20 +385,73 @@ async fn reader_to_log<T: io::AsyncRead + Unpin>(reader: T) {
     }
 }
 
+/// Streamed output passed on, but not credited back to the guest yet.
+#[derive(Default)]
+struct OutputCredit {
+    streams: HashMap<(u64, u32), u64>,
+    sending: bool,
+}
+
+/// Gives `len` bytes of output of a stream back to the guest, along with the
+/// same amount of channel credit. Output passed on while a credit is in flight
+/// is credited together with the next one, in a single batch.
+fn credit_output(
+    credit: &Arc<std::sync::Mutex<OutputCredit>>,
+    ga: Arc<GuestAgent>,
+    id: u64,
+    fd: u32,
+    len: u64,
+) {
+    {
+        let mut credit = credit.lock().unwrap();
+        *credit.streams.entry((id, fd)).or_default() += len;
+        if credit.sending {
+            return;
+        }
+        credit.sending = true;
+    }
+
+    let credit = credit.clone();
+    spawn(async move {
+        loop {
+            let streams = {
+                let mut credit = credit.lock().unwrap();
+                if credit.streams.is_empty() {
+                    credit.sending = false;
+                    return;
+                }
+                std::mem::take(&mut credit.streams)
+            };
+
+            let mut batch = Batch::new();
+            for ((id, fd), bytes) in streams {
+                batch.output_credit(id, fd as u8, bytes);
+            }
+            match ga.batch(batch).await {
+                Ok(Ok(responses)) => {
+                    for response in responses {
+                        if let Response::Err(e) = response {
+                            log::debug!("Remote error while crediting output: {:?}", e);
+                        }
+                    }
+                }
+                Ok(Err(e)) => log::debug!("Remote error while crediting output: {:?}", e),
+                Err(e) => log::error!("Error crediting output: {:?}", e),
+            }
+        }
+    });
+}
+
 async fn notification_into_status(
     notification: Notification,
-    ga: Arc<Mutex<GuestAgent>>,
-) -> server::ProcessStatus {
+    ga: Arc<GuestAgent>,
+) -> Option<server::ProcessStatus> {
     match notification {
         Notification::OutputAvailable { id, fd } => {
             log::debug!("Process {} has output available on fd {}", id, fd);
 
             let output = {
-                let result = {
-                    let mut guard = ga.lock().await;
-                    guard.query_output(id, fd as u8, 0, u64::MAX).await
-                };
-                match result {
+                match ga.query_output(id, fd as u8, 0, u64::MAX).await {
                     Ok(Ok(vec)) => vec,
                     Ok(Err(e)) => {
                         log::error!("Remote error while querying output: {:?}", e);
@@ -371,25 +468,50 @@ async fn notification_into_status(
                 _ => (Vec::new(), output),
             };
 
-            server::ProcessStatus {
+            Some(server::ProcessStatus {
                 pid: id,
                 running: true,
                 return_code: 0,
                 stdout,
                 stderr,
-            }
+            })
+        }
+        Notification::OutputData { id, fd, data } => {
+            log::trace!("Process {} sent {} bytes on fd {}", id, data.len(), fd);
+
+            let (stdout, stderr) = match fd {
+                1 => (data, Vec::new()),
+                _ => (Vec::new(), data),
+            };
+
+            Some(server::ProcessStatus {
+                pid: id,
+                running: true,
+                return_code: 0,
+                stdout,
+                stderr,
+            })
         }
         Notification::ProcessDied { id, reason } => {
             log::debug!("Process {} died with {:?}", id, reason);
 
             // TODO: reason._type ?
-            server::ProcessStatus {
+            Some(server::ProcessStatus {
                 pid: id,
                 running: false,
                 return_code: reason.status as i32,
                 stdout: Vec::new(),
                 stderr: Vec::new(),
-            }
+            })
+        }
+        Notification::OutputDropped { id, fd, dropped } => {
+            log::warn!(
+                "Process {} output on fd {} overwritten, {} bytes dropped so far",
+                id,
+                fd,
+                dropped
+            );
+            None
         }
     }
 }